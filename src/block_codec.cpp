@@ -0,0 +1,121 @@
+#include <iostream>
+#include <string>
+#include <errno.h>
+#ifdef STATEFS_LZ4
+#include <lz4.h>
+#endif
+#ifdef STATEFS_ZSTD
+#include <zstd.h>
+#endif
+#include "block_codec.hpp"
+
+namespace statefs
+{
+
+// zstd level used for preserved blocks. Low levels keep compression well ahead of the preservation rate.
+constexpr int ZSTD_BLOCK_LEVEL = 1;
+
+/**
+ * Returns whether blocks compressed with the given codec can be written and read by this build.
+ */
+bool is_codec_supported(const block_codec codec)
+{
+    switch (codec)
+    {
+    case block_codec::NONE:
+        return true;
+#ifdef STATEFS_LZ4
+    case block_codec::LZ4:
+        return true;
+#endif
+#ifdef STATEFS_ZSTD
+    case block_codec::ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * Parses a codec name given on the command line.
+ * @return True if the name is known and the codec is supported by this build.
+ */
+bool parse_codec(block_codec &codec, const std::string &name)
+{
+    if (name == "off")
+        codec = block_codec::NONE;
+    else if (name == "lz4")
+        codec = block_codec::LZ4;
+    else if (name == "zstd")
+        codec = block_codec::ZSTD;
+    else
+        return false;
+
+    return is_codec_supported(codec);
+}
+
+/**
+ * Compresses a block.
+ * @param dest Buffer with room for length bytes. A block is only kept compressed if it gets smaller.
+ * @return Compressed length. 0 if the block did not shrink or could not be compressed. It is then stored raw.
+ */
+size_t compress_block(const block_codec codec, const char *src, const size_t length, char *dest)
+{
+    switch (codec)
+    {
+#ifdef STATEFS_LZ4
+    case block_codec::LZ4:
+        return LZ4_compress_default(src, dest, length, length - 1);
+#endif
+#ifdef STATEFS_ZSTD
+    case block_codec::ZSTD:
+    {
+        thread_local ZSTD_CCtx *cctx = ZSTD_createCCtx();
+        const size_t res = ZSTD_compressCCtx(cctx, dest, length - 1, src, length, ZSTD_BLOCK_LEVEL);
+        return ZSTD_isError(res) ? 0 : res;
+    }
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Decompresses a stored block.
+ * @param storedlength Compressed length of the block.
+ * @param dest Buffer to hold the block.
+ * @param length Length of the block.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int decompress_block(const block_codec codec, const char *src, const size_t storedlength, char *dest, const size_t length)
+{
+    switch (codec)
+    {
+#ifdef STATEFS_LZ4
+    case block_codec::LZ4:
+        if (LZ4_decompress_safe(src, dest, storedlength, length) == (int)length)
+            return 0;
+        break;
+#endif
+#ifdef STATEFS_ZSTD
+    case block_codec::ZSTD:
+    {
+        thread_local ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        if (ZSTD_decompressDCtx(dctx, dest, length, src, storedlength) == length)
+            return 0;
+        break;
+    }
+#endif
+    default:
+        std::cerr << "Block codec " << (int)codec << " is not supported by this build\n";
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    std::cerr << "Corrupted compressed block\n";
+    errno = EIO;
+    return -1;
+}
+
+} // namespace statefs
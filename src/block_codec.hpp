@@ -0,0 +1,27 @@
+#ifndef _STATEFS_BLOCK_CODEC_
+#define _STATEFS_BLOCK_CODEC_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+
+namespace statefs
+{
+
+// Compression of preserved blocks in the delta segment. Codecs are optional at build time
+// (STATEFS_LZ4 / STATEFS_ZSTD). Raw blocks are always supported.
+enum class block_codec : uint8_t
+{
+    NONE = 0,
+    LZ4 = 1,
+    ZSTD = 2
+};
+
+bool is_codec_supported(const block_codec codec);
+bool parse_codec(block_codec &codec, const std::string &name);
+size_t compress_block(const block_codec codec, const char *src, const size_t length, char *dest);
+int decompress_block(const block_codec codec, const char *src, const size_t storedlength, char *dest, const size_t length);
+
+} // namespace statefs
+
+#endif
@@ -0,0 +1,438 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <unordered_set>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include "state_common.hpp"
+#include "delta_manifest.hpp"
+
+namespace statefs
+{
+
+int read_manifestfile(delta_manifest &manifest, const std::string &deltadir);
+int read_legacy_manifest(delta_manifest &manifest, const std::string &deltadir);
+int read_legacy_blockindex(delta_file &file, const std::string &deltadir);
+
+/**
+ * Returns the preserved state of the given file. NULL if the file was not touched.
+ */
+const delta_file *delta_manifest::find(const std::string &relpath) const
+{
+    const auto itr = filepositions.find(relpath);
+    return itr == filepositions.end() ? NULL : &files[itr->second];
+}
+
+/**
+ * Returns the preserved state of the touched file which is at the given path at the end of the session.
+ * This is the only file whose current contents are its original blocks overlaid with the changed ones.
+ * NULL if no touched file is there (eg. the original file was deleted or renamed away).
+ */
+const delta_file *delta_manifest::find_current(const std::string &relpath) const
+{
+    const auto itr = currentpositions.find(relpath);
+    return itr == currentpositions.end() ? NULL : &files[itr->second];
+}
+
+/**
+ * Reads the index of all the preserved state in a delta dir. Deltas written with the old layout
+ * (touched files index plus per-file block cache and index) are read as well.
+ * @param manifest The manifest to populate. Left empty if nothing was preserved.
+ * @param deltadir The delta dir.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int read_delta_manifest(delta_manifest &manifest, const std::string &deltadir)
+{
+    const std::string manifestfile = deltadir + DELTA_MANIFEST_FNAME;
+    const int ret = boost::filesystem::exists(manifestfile) ? read_manifestfile(manifest, deltadir) : read_legacy_manifest(manifest, deltadir);
+    if (ret == -1)
+        return -1;
+
+    for (size_t pos = 0; pos < manifest.files.size(); pos++)
+    {
+        if (!manifest.files[pos].deleted)
+            manifest.currentpositions[manifest.files[pos].currentpath] = pos;
+    }
+
+    return 0;
+}
+
+int read_legacy_manifest(delta_manifest &manifest, const std::string &deltadir)
+{
+    // Old layout. Each touched file has its own block index next to its block cache.
+    std::ifstream infile(deltadir + IDX_TOUCHEDFILES);
+    for (std::string relpath; std::getline(infile, relpath);)
+    {
+        if (manifest.filepositions.count(relpath) > 0)
+            continue;
+
+        delta_file file;
+        file.relpath = relpath;
+        file.blocksize = BLOCK_SIZE;
+        file.currentpath = relpath;
+        if (read_legacy_blockindex(file, deltadir) == -1)
+            return -1;
+
+        manifest.filepositions.emplace(relpath, manifest.files.size());
+        manifest.files.push_back(std::move(file));
+    }
+
+    return 0;
+}
+
+int read_manifestfile(delta_manifest &manifest, const std::string &deltadir)
+{
+    const std::string manifestfile = deltadir + DELTA_MANIFEST_FNAME;
+    const std::string segmentfile = deltadir + DELTA_SEGMENT_FNAME;
+
+    std::ifstream infile(manifestfile, std::ios::binary | std::ios::ate);
+    const std::streamsize size = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+
+    std::vector<char> buf(size);
+    if (!infile.read(buf.data(), size))
+    {
+        std::cerr << errno << ": Read failed " << manifestfile << "\n";
+        return -1;
+    }
+
+    // An empty manifest has not been written to yet.
+    if (size == 0)
+        return 0;
+
+    uint32_t magic = 0, version = 0;
+    if (size >= (std::streamsize)MANIFEST_HEADER_SIZE)
+    {
+        memcpy(&magic, buf.data(), 4);
+        memcpy(&version, buf.data() + 4, 4);
+    }
+    if (magic != MANIFEST_MAGIC || version != MANIFEST_VERSION)
+    {
+        std::cerr << "Unsupported delta manifest " << manifestfile << "\n";
+        return -1;
+    }
+    manifest.version = version;
+    manifest.length = MANIFEST_HEADER_SIZE;
+
+    // File id-->position in manifest files. Records of several file ids may belong to the same path.
+    std::unordered_map<uint32_t, size_t> fileids;
+
+    // A partially written record at the end (eg. monitor did not exit cleanly) is ignored.
+    const char *ptr = buf.data();
+    for (size_t pos = MANIFEST_HEADER_SIZE; pos < buf.size();)
+    {
+        const char type = ptr[pos];
+        if (type == MANIFEST_FILE_RECORD)
+        {
+            if (pos + MANIFEST_FILERECORD_SIZE > buf.size())
+                break;
+
+            uint32_t fileid = 0, blocksize = 0, pathlen = 0;
+            off_t original_length = 0;
+            memcpy(&fileid, ptr + pos + 1, 4);
+            memcpy(&original_length, ptr + pos + 5, 8);
+            memcpy(&blocksize, ptr + pos + 13, 4);
+            memcpy(&pathlen, ptr + pos + 17, 4);
+            if (pos + MANIFEST_FILERECORD_SIZE + pathlen > buf.size())
+                break;
+
+            if (!is_valid_blocksize(blocksize))
+            {
+                std::cerr << "Unsupported block size " << blocksize << " in " << manifestfile << "\n";
+                return -1;
+            }
+
+            std::string relpath(ptr + pos + MANIFEST_FILERECORD_SIZE, pathlen);
+            pos += MANIFEST_FILERECORD_SIZE + pathlen;
+
+            // The first record of a path holds its original state.
+            const auto [itr, inserted] = manifest.filepositions.try_emplace(relpath, manifest.files.size());
+            if (inserted)
+            {
+                delta_file &file = manifest.files.emplace_back();
+                file.currentpath = relpath;
+                file.relpath = std::move(relpath);
+                file.fileid = fileid;
+                file.original_length = original_length;
+                file.blocksize = blocksize;
+                file.cachefile = segmentfile;
+            }
+
+            fileids[fileid] = itr->second;
+            manifest.maxfileid = std::max(manifest.maxfileid, fileid);
+        }
+        else if (type == MANIFEST_BLOCK_RECORD)
+        {
+            if (pos + MANIFEST_BLOCKRECORD_SIZE > buf.size())
+                break;
+
+            uint32_t fileid = 0, blockno = 0;
+            delta_block block;
+            memcpy(&fileid, ptr + pos + 1, 4);
+            memcpy(&blockno, ptr + pos + 5, 4);
+            memcpy(&block.cacheoffset, ptr + pos + 9, 8);
+            memcpy(&block.storedlength, ptr + pos + 17, 4);
+            const uint8_t codec = ptr[pos + 21];
+            block.codec = (block_codec)(codec & ~MANIFEST_STOREDBLOCK_FLAG);
+            block.instore = codec & MANIFEST_STOREDBLOCK_FLAG;
+            memcpy(&block.hash, ptr + pos + MANIFEST_BLOCKRECORD_HASHPOS, 32);
+            pos += MANIFEST_BLOCKRECORD_SIZE;
+
+            const auto itr = fileids.find(fileid);
+            if (itr == fileids.end())
+            {
+                std::cerr << "Block record of unknown file " << fileid << " in " << manifestfile << "\n";
+                return -1;
+            }
+
+            // Every record holds a reference to its store block, including the ones superseded below.
+            if (block.instore)
+                manifest.storerefs.push_back(block.cacheoffset);
+            else if (block.storedlength > 0)
+                manifest.segmentlength = std::max(manifest.segmentlength, block.cacheoffset + (off_t)block.storedlength);
+
+            // The first preserved copy of a block is the original.
+            manifest.files[itr->second].blocks.try_emplace(blockno, block);
+        }
+        else if (type == MANIFEST_LINK_RECORD)
+        {
+            if (pos + MANIFEST_LINKRECORD_SIZE > buf.size())
+                break;
+
+            uint32_t fileid = 0, namelen = 0;
+            memcpy(&fileid, ptr + pos + 1, 4);
+            memcpy(&namelen, ptr + pos + 5, 4);
+            if (pos + MANIFEST_LINKRECORD_SIZE + namelen > buf.size())
+                break;
+
+            const std::string linkname(ptr + pos + MANIFEST_LINKRECORD_SIZE, namelen);
+            pos += MANIFEST_LINKRECORD_SIZE + namelen;
+
+            const auto itr = fileids.find(fileid);
+            if (itr == fileids.end())
+            {
+                std::cerr << "Link record of unknown file " << fileid << " in " << manifestfile << "\n";
+                return -1;
+            }
+
+            delta_file &file = manifest.files[itr->second];
+            if (file.linkfile.empty())
+                file.linkfile = deltadir + linkname;
+            file.deleted = true;
+        }
+        else if (type == MANIFEST_RENAME_RECORD)
+        {
+            if (pos + MANIFEST_RENAMERECORD_SIZE > buf.size())
+                break;
+
+            uint32_t fileid = 0, fromlen = 0, tolen = 0;
+            memcpy(&fileid, ptr + pos + 1, 4);
+            memcpy(&fromlen, ptr + pos + 5, 4);
+            memcpy(&tolen, ptr + pos + 9, 4);
+            if (pos + MANIFEST_RENAMERECORD_SIZE + fromlen + tolen > buf.size())
+                break;
+
+            delta_rename rename;
+            rename.from.assign(ptr + pos + MANIFEST_RENAMERECORD_SIZE, fromlen);
+            rename.to.assign(ptr + pos + MANIFEST_RENAMERECORD_SIZE + fromlen, tolen);
+            pos += MANIFEST_RENAMERECORD_SIZE + fromlen + tolen;
+
+            const auto itr = fileids.find(fileid);
+            if (itr == fileids.end())
+            {
+                std::cerr << "Rename record of unknown file " << fileid << " in " << manifestfile << "\n";
+                return -1;
+            }
+
+            delta_file &file = manifest.files[itr->second];
+            if (rename.to.empty())
+            {
+                file.deleted = true;
+            }
+            else
+            {
+                file.currentpath = rename.to;
+                manifest.renames.push_back(std::move(rename));
+            }
+        }
+        else
+        {
+            std::cerr << "Invalid record at " << pos << " in " << manifestfile << "\n";
+            return -1;
+        }
+
+        manifest.length = pos;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the block index of a file preserved with the old layout.
+ * Index format: [original length(8 bytes)] followed by [blocknum(4 bytes) | cacheoffset(8 bytes) | blockhash(32 bytes)] entries.
+ */
+int read_legacy_blockindex(delta_file &file, const std::string &deltadir)
+{
+    file.cachefile = deltadir + file.relpath + BLOCKCACHE_EXT;
+
+    const std::string bindexfile = deltadir + file.relpath + BLOCKINDEX_EXT;
+    if (!boost::filesystem::exists(bindexfile))
+        return 0;
+
+    std::ifstream infile(bindexfile, std::ios::binary | std::ios::ate);
+    const std::streamsize idxsize = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+
+    std::vector<char> bindex(idxsize);
+    if (!infile.read(bindex.data(), idxsize))
+    {
+        std::cerr << errno << ": Read failed " << bindexfile << "\n";
+        return -1;
+    }
+
+    if (bindex.size() >= 8)
+        memcpy(&file.original_length, bindex.data(), 8);
+
+    for (size_t idxoffset = 8; idxoffset + BLOCKINDEX_ENTRY_SIZE <= bindex.size(); idxoffset += BLOCKINDEX_ENTRY_SIZE)
+    {
+        uint32_t blockno = 0;
+        delta_block block;
+        memcpy(&blockno, bindex.data() + idxoffset, 4);
+        memcpy(&block.cacheoffset, bindex.data() + idxoffset + 4, 8);
+        memcpy(&block.hash, bindex.data() + idxoffset + 12, 32);
+        block.storedlength = BLOCK_SIZE;
+        file.blocks.try_emplace(blockno, block);
+    }
+
+    return 0;
+}
+
+void append_manifestheader(std::vector<char> &buf)
+{
+    const size_t pos = buf.size();
+    buf.resize(pos + MANIFEST_HEADER_SIZE);
+    memcpy(buf.data() + pos, &MANIFEST_MAGIC, 4);
+    memcpy(buf.data() + pos + 4, &MANIFEST_VERSION, 4);
+}
+
+void append_filerecord(std::vector<char> &buf, const uint32_t fileid, const off_t original_length, const uint32_t blocksize, std::string_view relpath)
+{
+    const uint32_t pathlen = relpath.length();
+    const size_t pos = buf.size();
+    buf.resize(pos + MANIFEST_FILERECORD_SIZE + pathlen);
+
+    char *record = buf.data() + pos;
+    record[0] = MANIFEST_FILE_RECORD;
+    memcpy(record + 1, &fileid, 4);
+    memcpy(record + 5, &original_length, 8);
+    memcpy(record + 13, &blocksize, 4);
+    memcpy(record + 17, &pathlen, 4);
+    memcpy(record + MANIFEST_FILERECORD_SIZE, relpath.data(), pathlen);
+}
+
+/**
+ * Appends a block record of a raw block to the buffer. The block hash is written as zeros and filled in later.
+ */
+void append_blockrecord(std::vector<char> &buf, const uint32_t fileid, const uint32_t blockno, const off_t cacheoffset, const uint32_t storedlength)
+{
+    const size_t pos = buf.size();
+    buf.resize(pos + MANIFEST_BLOCKRECORD_SIZE, 0);
+
+    char *record = buf.data() + pos;
+    record[0] = MANIFEST_BLOCK_RECORD;
+    memcpy(record + 1, &fileid, 4);
+    memcpy(record + 5, &blockno, 4);
+    memcpy(record + 9, &cacheoffset, 8);
+    memcpy(record + 17, &storedlength, 4);
+}
+
+/**
+ * Reads a preserved block from the cache file, decompressing it if it is stored compressed.
+ * Zero blocks are not stored and are simply filled in.
+ * @param cachefd fd of the cache file. fd of the block store data file if the block is kept in the store.
+ * @param block The preserved block.
+ * @param buf Buffer to hold the block.
+ * @param blocksize Block size of the file the block belongs to.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int read_delta_block(const int cachefd, const delta_block &block, char *buf, const uint32_t blocksize)
+{
+    if (block.storedlength == 0)
+    {
+        memset(buf, 0, blocksize);
+        return 0;
+    }
+
+    if (block.codec == block_codec::NONE)
+        return pread(cachefd, buf, blocksize, block.cacheoffset) == blocksize ? 0 : -1;
+
+    thread_local std::vector<char> storedbuf;
+    storedbuf.resize(block.storedlength);
+    if (pread(cachefd, storedbuf.data(), block.storedlength, block.cacheoffset) != block.storedlength)
+        return -1;
+
+    return decompress_block(block.codec, storedbuf.data(), block.storedlength, buf, blocksize);
+}
+
+void append_linkrecord(std::vector<char> &buf, const uint32_t fileid, std::string_view linkname)
+{
+    const uint32_t namelen = linkname.length();
+    const size_t pos = buf.size();
+    buf.resize(pos + MANIFEST_LINKRECORD_SIZE + namelen);
+
+    char *record = buf.data() + pos;
+    record[0] = MANIFEST_LINK_RECORD;
+    memcpy(record + 1, &fileid, 4);
+    memcpy(record + 5, &namelen, 4);
+    memcpy(record + MANIFEST_LINKRECORD_SIZE, linkname.data(), namelen);
+}
+
+void append_renamerecord(std::vector<char> &buf, const uint32_t fileid, std::string_view from, std::string_view to)
+{
+    const uint32_t fromlen = from.length(), tolen = to.length();
+    const size_t pos = buf.size();
+    buf.resize(pos + MANIFEST_RENAMERECORD_SIZE + fromlen + tolen);
+
+    char *record = buf.data() + pos;
+    record[0] = MANIFEST_RENAME_RECORD;
+    memcpy(record + 1, &fileid, 4);
+    memcpy(record + 5, &fromlen, 4);
+    memcpy(record + 9, &tolen, 4);
+    memcpy(record + MANIFEST_RENAMERECORD_SIZE, from.data(), fromlen);
+    memcpy(record + MANIFEST_RENAMERECORD_SIZE + fromlen, to.data(), tolen);
+}
+
+/**
+ * Reads the new files of a delta. The new files log is replayed on top of the index. A partial last line
+ * of the log (from an unclean exit) is ignored.
+ * @param newfiles Set to add the relative paths of the new files to.
+ * @param deltadir Delta dir of the session.
+ */
+void read_newfiles(std::unordered_set<std::string> &newfiles, const std::string &deltadir)
+{
+    std::ifstream indexfile(deltadir + IDX_NEWFILES);
+    for (std::string relpath; std::getline(indexfile, relpath);)
+        newfiles.emplace(relpath);
+
+    std::ifstream logfile(deltadir + LOG_NEWFILES);
+    for (std::string record; std::getline(logfile, record);)
+    {
+        if (logfile.eof() || record.empty())
+            break;
+
+        if (record[0] == NEWFILES_CREATE_RECORD)
+            newfiles.emplace(record.substr(1));
+        else if (record[0] == NEWFILES_REMOVE_RECORD)
+            newfiles.erase(record.substr(1));
+    }
+}
+
+void append_newfilerecord(std::vector<char> &buf, const char type, std::string_view relpath)
+{
+    buf.push_back(type);
+    buf.insert(buf.end(), relpath.begin(), relpath.end());
+    buf.push_back('\n');
+}
+
+} // namespace statefs
@@ -0,0 +1,120 @@
+#ifndef _STATEFS_DELTA_MANIFEST_
+#define _STATEFS_DELTA_MANIFEST_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include "hasher.hpp"
+#include "block_codec.hpp"
+
+namespace statefs
+{
+
+// The delta of a session is stored as one segment file holding the preserved blocks of all files
+// back to back, and one manifest holding the records which describe them.
+// Manifest format: [magic(4 bytes) | version(4 bytes)] followed by records.
+// File record:  ['F' | fileid(4 bytes) | original length(8 bytes) | block size(4 bytes) | path length(4 bytes) | relative path]
+// Block record: ['B' | fileid(4 bytes) | blocknum(4 bytes) | segment offset(8 bytes) | stored length(4 bytes) | codec(1 byte) | blockhash(32 bytes)]
+//                A stored length of 0 means the block was all zeros (eg. a hole) and nothing is stored for it.
+//                If the codec has the block store flag set, the block is kept in the shared block store and
+//                the segment offset is its offset in the store.
+// Link record:  ['L' | fileid(4 bytes) | name length(4 bytes) | name of the hard link to the deleted file, relative to the delta dir]
+// Rename record: ['R' | fileid(4 bytes) | from length(4 bytes) | to length(4 bytes) | from path | to path]
+//                An empty to path means the file was deleted (and its blocks preserved).
+constexpr uint32_t MANIFEST_MAGIC = 0x4d444653; // "SFDM"
+constexpr uint32_t MANIFEST_VERSION = 1;
+constexpr size_t MANIFEST_HEADER_SIZE = 8;
+
+constexpr char MANIFEST_FILE_RECORD = 'F';
+constexpr char MANIFEST_BLOCK_RECORD = 'B';
+constexpr char MANIFEST_LINK_RECORD = 'L';
+constexpr char MANIFEST_RENAME_RECORD = 'R';
+constexpr size_t MANIFEST_FILERECORD_SIZE = 21; // Without the path.
+constexpr size_t MANIFEST_BLOCKRECORD_SIZE = 54;
+constexpr size_t MANIFEST_BLOCKRECORD_OFFSETPOS = 9; // Segment offset, stored length, codec and hash follow from here.
+constexpr size_t MANIFEST_BLOCKRECORD_HASHPOS = 22;
+constexpr size_t MANIFEST_LINKRECORD_SIZE = 9; // Without the name.
+constexpr size_t MANIFEST_RENAMERECORD_SIZE = 13; // Without the paths.
+constexpr uint8_t MANIFEST_STOREDBLOCK_FLAG = 0x80;  // Codec flag of blocks kept in the block store.
+
+// The new files index holds one relative path per line. Creates and removals of new files since the index
+// was last written are appended to the new files log, one line each: ['+' or '-' | relative path].
+// The log is replayed on top of the index, so new files survive an unclean exit of the session.
+constexpr char NEWFILES_CREATE_RECORD = '+';
+constexpr char NEWFILES_REMOVE_RECORD = '-';
+
+// A preserved block of a file.
+struct delta_block
+{
+    off_t cacheoffset;                    // Offset of the block in the cache file.
+    uint32_t storedlength = 0;            // No. of bytes the block takes in the cache file. 0 if the block is all zeros.
+    block_codec codec = block_codec::NONE; // Compression of the stored block.
+    bool instore = false;                 // Whether the block is kept in the block store instead of the cache file.
+    hasher::B2H hash;                     // Zero if the hash was not computed by the state monitor.
+};
+
+// Preserved state of a file touched during the session.
+struct delta_file
+{
+    std::string relpath; // Original path of the file.
+    uint32_t fileid = 0; // Id of the first file record of the file. 0 for the old layout.
+    off_t original_length = 0;
+    uint32_t blocksize = 0; // Size of the preserved blocks.
+
+    // Where the file is at the end of the session if it was renamed. Not applicable if deleted.
+    std::string currentpath;
+    bool deleted = false;
+
+    // File holding the preserved blocks. This is the session segment or the per-file block cache of the old layout.
+    std::string cachefile;
+
+    // Hard link to the original inode if the file was deleted. Empty otherwise. The preserved blocks
+    // are the ones overwritten before the delete (or through handles still open after it) and go on top of it.
+    std::string linkfile;
+
+    // Block no.-->preserved block. Ordered so blocks contiguous in the cache file can be restored together.
+    std::map<uint32_t, delta_block> blocks;
+};
+
+// A rename of an original file during the session.
+struct delta_rename
+{
+    std::string from;
+    std::string to;
+};
+
+// Index of all the preserved state in a delta dir.
+struct delta_manifest
+{
+    std::vector<delta_file> files;                            // In the order the files were first touched.
+    std::unordered_map<std::string, size_t> filepositions;    // Original relative path-->position in files.
+    std::unordered_map<std::string, size_t> currentpositions; // Current relative path-->position in files.
+    std::vector<delta_rename> renames;                        // In the order they happened.
+    uint32_t maxfileid = 0;                                   // Largest file id in the manifest.
+    uint32_t version = 0;                                     // Manifest format version. 0 if there is no manifest.
+    off_t length = 0;                                         // Length of the manifest up to the last complete record.
+    off_t segmentlength = 0;                                  // End of the last block recorded in the segment.
+    std::vector<off_t> storerefs;                             // Block store offset referenced by each block record.
+
+    const delta_file *find(const std::string &relpath) const;
+    const delta_file *find_current(const std::string &relpath) const;
+};
+
+int read_delta_manifest(delta_manifest &manifest, const std::string &deltadir);
+void append_filerecord(std::vector<char> &buf, const uint32_t fileid, const off_t original_length, const uint32_t blocksize, std::string_view relpath);
+void append_blockrecord(std::vector<char> &buf, const uint32_t fileid, const uint32_t blockno, const off_t cacheoffset, const uint32_t storedlength);
+int read_delta_block(const int cachefd, const delta_block &block, char *buf, const uint32_t blocksize);
+void append_linkrecord(std::vector<char> &buf, const uint32_t fileid, std::string_view linkname);
+void append_renamerecord(std::vector<char> &buf, const uint32_t fileid, std::string_view from, std::string_view to);
+void append_manifestheader(std::vector<char> &buf);
+void read_newfiles(std::unordered_set<std::string> &newfiles, const std::string &deltadir);
+void append_newfilerecord(std::vector<char> &buf, const char type, std::string_view relpath);
+
+} // namespace statefs
+
+#endif
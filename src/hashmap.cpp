@@ -0,0 +1,97 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include "hashtree_builder.hpp"
+#include "state_restore.hpp"
+#include "state_common.hpp"
+#include "hasher.hpp"
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2)
+    {
+        std::string arg1 = argv[1];
+        if (arg1.find(".bhmap") != std::string::npos)
+        {
+            std::string file = realpath(argv[1], NULL);
+            int fd = open(file.c_str(), O_RDONLY);
+
+            // Print the first 4 hashes in bhmap file (after the header if there is one).
+            hasher::B2H hash[4];
+            const off_t size = lseek(fd, 0, SEEK_END);
+            int res = pread(fd, hash, 128, size % hasher::HASH_SIZE == statefs::HASHMAP_HEADER_SIZE ? statefs::HASHMAP_HEADER_SIZE : 0);
+            for (int i = 0; i < 4; i++)
+                std::cout << std::hex << hash[i] << "\n";
+            close(fd);
+        }
+        else if (arg1.find("dir.hash") != std::string::npos)
+        {
+            std::string file = realpath(argv[1], NULL);
+            int fd = open(file.c_str(), O_RDONLY);
+
+            // Print dir hash.
+            hasher::B2H hash;
+            int res = read(fd, &hash, 32);
+            std::cout << std::hex << hash << "\n";
+            close(fd);
+        }
+        else
+        {
+            statefs::statedir_context ctx = statefs::init(argv[1]);
+            statefs::hashtree_builder builder(ctx);
+            if (ctx.deltadir.empty() || builder.generate() == -1)
+            {
+                std::cerr << "Generation failed\n";
+                exit(1);
+            }
+
+            // Print root hash.
+            int fd = open(std::string(ctx.hashtreedir).append("/dir.hash").c_str(), O_RDONLY);
+            hasher::B2H hash;
+            int res = read(fd, &hash, 32);
+            std::cout << "State hash: " << std::hex << hash << "\n";
+            close(fd);
+        }
+
+        std::cout << "Done.\n";
+    }
+    else if ((argc == 3 || argc == 4) && std::string(argv[1]) == "restore")
+    {
+        // Optional no. of checkpoints to roll back. Defaults to the latest one.
+        uint64_t count = 1;
+        if (argc == 4)
+        {
+            const std::string countarg = argv[3];
+            errno = 0;
+            count = strtoull(countarg.c_str(), NULL, 10);
+            if (countarg.empty() || countarg.find_first_not_of("0123456789") != std::string::npos || errno == ERANGE || count == 0)
+            {
+                std::cerr << "Incorrect checkpoint count " << countarg << ". Usage: hashmap restore <state hist dir> [count]\n";
+                exit(1);
+            }
+        }
+
+        statefs::statedir_context dirctx = statefs::init(argv[2]);
+        statefs::state_restore staterestore;
+        if (staterestore.rollback(count) == -1)
+        {
+            std::cerr << (staterestore.changed ? "Rollback failed part way through. The state is partly rolled back.\n" : "Rollback failed.\n");
+            exit(1);
+        }
+
+        // Print root hash.
+        int fd = open(std::string(dirctx.hashtreedir).append("/dir.hash").c_str(), O_RDONLY);
+        hasher::B2H hash;
+        int res = read(fd, &hash, 32);
+        std::cout << "State hash: " << std::hex << hash << "\n";
+        close(fd);
+    }
+    else
+    {
+        std::cerr << "Incorrect arguments.\n";
+        exit(1);
+    }
+}
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <cmath>
 #include <boost/filesystem.hpp>
 #include "state_common.hpp"
@@ -12,7 +13,8 @@
 namespace statefs
 {
 
-hashmap_builder::hashmap_builder(const statedir_context &ctx) : ctx(ctx)
+hashmap_builder::hashmap_builder(const statedir_context &ctx, const delta_manifest &deltamanifest, const bool restored)
+    : ctx(ctx), deltamanifest(deltamanifest), restored(restored)
 {
 }
 
@@ -20,10 +22,10 @@ int hashmap_builder::generate_hashmap_forfile(hasher::B2H &parentdirhash, const
 {
     // We attempt to avoid a full rebuild of the block hash map file when possible.
     // For this optimisation, both the block hash map (.bhmap) file and the
-    // delta block index (.bindex) file must exist.
+    // delta manifest entry of the file must exist.
 
-    // If the block index exists, we generate/update the hashmap file with the aid of that.
-    // Block index file contains the updated blockids. If not, we simply rehash all the blocks.
+    // If the file has preserved blocks, we generate/update the hashmap file with the aid of those.
+    // The preserved blocks are the updated blockids. If not, we simply rehash all the blocks.
 
     std::string relpath = get_relpath(filepath, ctx.datadir);
 
@@ -35,40 +37,78 @@ int hashmap_builder::generate_hashmap_forfile(hasher::B2H &parentdirhash, const
         return -1;
     }
     const off_t orifilelength = lseek(orifd, 0, SEEK_END);
-    uint32_t blockcount = ceil((double)orifilelength / (double)BLOCK_SIZE);
+
+    // Holes of sparse files are hashed as zero blocks without reading them.
+    struct stat stat_buf;
+    if (fstat(orifd, &stat_buf) == 0 && stat_buf.st_blocks * 512 < stat_buf.st_size)
+        holes.emplace(orifd);
+    else
+        holes.reset();
+    const uint32_t blocksize = get_blocksize(orifilelength);
+    uint32_t blockcount = ceil((double)orifilelength / (double)blocksize);
 
     // Attempt to read the existing block hash map file.
     std::string bhmapfile;
-    std::vector<char> bhmapdata;
-    if (read_blockhashmap(bhmapdata, bhmapfile, relpath) == -1)
+    block_hashmap bhmap;
+    if (read_blockhashmap(bhmap, bhmapfile, relpath) == -1)
         return -1;
 
     hasher::B2H oldfilehash = {0, 0, 0, 0};
-    if (!bhmapdata.empty())
-        memcpy(&oldfilehash, bhmapdata.data(), hasher::HASH_SIZE);
+    if (!bhmap.hashes.empty())
+        memcpy(&oldfilehash, bhmap.hashes.data(), hasher::HASH_SIZE);
+
+    // Attempt to read the preserved blocks of the file. Only a touched file which is at this path at the end of the
+    // session (or after a restore, the original file restored back to its path) has its contents made of its base
+    // blocks and the changed ones. Anything else (eg. a file replaced by another one) gets fully rehashed.
+    const delta_file *deltafile = restored ? deltamanifest.find(relpath) : deltamanifest.find_current(relpath);
+    if (deltafile != NULL && deltafile->deleted)
+        deltafile = NULL;
 
-    // Attempt to read the delta block index file.
     std::map<uint32_t, hasher::B2H> bindex;
-    if (get_blockindex(bindex, blockcount, relpath) == -1)
+    if (deltafile != NULL && get_blockindex(bindex, *deltafile) == -1)
         return -1;
 
+    // Block hashes of the base file to build upon. A file which moved between paths carries over the hashes
+    // from its previous path. The base hashes are of no use if the file moved into a different block size tier.
+    const block_hashmap *basehashmap = NULL;
+    if (deltafile != NULL)
+    {
+        if (deltafile->relpath == deltafile->currentpath)
+        {
+            basehashmap = &bhmap;
+        }
+        else
+        {
+            const auto itr = renamedhashmaps.find(relpath);
+            if (itr != renamedhashmaps.end())
+                basehashmap = &itr->second;
+        }
+    }
+    const std::vector<char> *basehashes = NULL;
+    if (basehashmap != NULL && !basehashmap->hashes.empty() && basehashmap->blocksize == blocksize)
+        basehashes = &basehashmap->hashes;
+    const uint32_t deltablocksize = deltafile != NULL ? deltafile->blocksize : blocksize;
+
     // Array to contain the updated block hashes.
-    hasher::B2H hashes[1 + blockcount]; // slot 0 is for the root hash.
+    std::vector<hasher::B2H> hashes(1 + blockcount); // slot 0 is for the root hash.
     const size_t hashes_size = (1 + blockcount) * hasher::HASH_SIZE;
-    
-    if (update_hashes(hashes, hashes_size, relpath, orifd, blockcount, bindex, bhmapdata) == -1)
+
+    const int ret = with_blocksize(blocksize, [&](auto bs) {
+        return update_hashes<decltype(bs)::value>(hashes.data(), hashes_size, relpath, orifd, blockcount, bindex, deltablocksize, basehashes);
+    });
+    if (ret == -1)
         return -1;
 
-    if (write_blockhashmap(bhmapfile, hashes, hashes_size) == -1)
+    if (write_blockhashmap(bhmapfile, blocksize, hashes.data(), hashes_size) == -1)
         return -1;
 
-    if (update_hashtree_entry(parentdirhash, !bhmapdata.empty(), oldfilehash, hashes[0], bhmapfile, relpath) == -1)
+    if (update_hashtree_entry(parentdirhash, !bhmap.hashes.empty(), oldfilehash, hashes[0], bhmapfile, relpath) == -1)
         return -1;
 
     return 0;
 }
 
-int hashmap_builder::read_blockhashmap(std::vector<char> &bhmapdata, std::string &bhmapfile, const std::string &relpath)
+int hashmap_builder::read_blockhashmap(block_hashmap &bhmap, std::string &bhmapfile, const std::string &relpath)
 {
     bhmapfile.reserve(ctx.blockhashmapdir.length() + relpath.length() + HASHMAP_EXT_LEN);
     bhmapfile.append(ctx.blockhashmapdir).append(relpath).append(HASHMAP_EXT);
@@ -83,13 +123,32 @@ int hashmap_builder::read_blockhashmap(std::vector<char> &bhmapdata, std::string
         }
 
         off_t size = lseek(hmapfd, 0, SEEK_END);
-        bhmapdata.resize(size);
 
-        if (pread(hmapfd, bhmapdata.data(), size, 0) == -1)
+        // Hash maps without the header are of the default block size.
+        off_t hashesoffset = 0;
+        bhmap.blocksize = BLOCK_SIZE;
+        if (size % hasher::HASH_SIZE == HASHMAP_HEADER_SIZE)
+        {
+            uint32_t header[2];
+            if (pread(hmapfd, header, HASHMAP_HEADER_SIZE, 0) == -1)
+            {
+                std::cerr << errno << ": Read failed " << bhmapfile << '\n';
+                close(hmapfd);
+                return -1;
+            }
+            if (header[0] == HASHMAP_MAGIC && is_valid_blocksize(header[1]))
+                bhmap.blocksize = header[1];
+            hashesoffset = HASHMAP_HEADER_SIZE;
+        }
+
+        bhmap.hashes.resize(size - hashesoffset);
+        if (pread(hmapfd, bhmap.hashes.data(), bhmap.hashes.size(), hashesoffset) == -1)
         {
             std::cerr << errno << ": Read failed " << bhmapfile << '\n';
+            close(hmapfd);
             return -1;
         }
+        close(hmapfd);
     }
     else
     {
@@ -105,66 +164,101 @@ int hashmap_builder::read_blockhashmap(std::vector<char> &bhmapdata, std::string
     return 0;
 }
 
-int hashmap_builder::get_blockindex(std::map<uint32_t, hasher::B2H> &idxmap, uint32_t &blockcount, const std::string &filerelpath)
+/**
+ * Reads the block hashes of each renamed file from the path it had before the data files were last changed, so
+ * they can be carried over to the path it has now. That is the session start path after a session and the session
+ * end path after a restore. This must be done before any hash maps get updated since those paths may be reused.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int hashmap_builder::load_renamedhashmaps()
 {
-    std::string bindexfile;
-    bindexfile.reserve(ctx.deltadir.length() + filerelpath.length() + BLOCKINDEX_EXT_LEN);
-    bindexfile.append(ctx.deltadir).append(filerelpath).append(BLOCKINDEX_EXT);
-
-    if (boost::filesystem::exists(bindexfile))
+    for (const delta_file &file : deltamanifest.files)
     {
-        std::ifstream infile(bindexfile, std::ios::binary | std::ios::ate);
-        std::streamsize idxsize = infile.tellg();
-        infile.seekg(0, std::ios::beg);
+        if (file.deleted || file.currentpath == file.relpath)
+            continue;
 
-        // Read the block index file into a vector.
-        std::vector<char> bindex(idxsize);
-        if (infile.read(bindex.data(), idxsize))
-        {
-            // First 8 bytes contain the original file length. Skip it.
-            // Skip the first 8 bytes and loop through index entries.
-            for (uint32_t idxoffset = 8; idxoffset < bindex.size();)
-            {
-                // Read the block no. (4 bytes) of where this block is from in the original file.
-                uint32_t blockno = 0;
-                memcpy(&blockno, bindex.data() + idxoffset, 4);
-                idxoffset += 12; // Skip the cached block offset (8 bytes)
+        const std::string &frompath = restored ? file.currentpath : file.relpath;
+        const std::string &topath = restored ? file.relpath : file.currentpath;
 
-                // Read the block hash (32 bytes).
-                hasher::B2H hash;
-                memcpy(&hash, bindex.data() + idxoffset, 32);
-                idxoffset += 32;
+        std::string bhmapfile;
+        block_hashmap bhmap;
+        if (read_blockhashmap(bhmap, bhmapfile, frompath) == -1)
+            return -1;
 
-                idxmap.try_emplace(blockno, hash);
-            }
-        }
-        else
+        if (!bhmap.hashes.empty())
+            renamedhashmaps.emplace(topath, std::move(bhmap));
+    }
+
+    return 0;
+}
+
+int hashmap_builder::get_blockindex(std::map<uint32_t, hasher::B2H> &idxmap, const delta_file &deltafile)
+{
+    // Block hashes are filled in by the state monitor in the background. If the monitor did not
+    // get to finish them, we compute the missing ones from the cached blocks. After a restore only the
+    // block nos. are of use since the restored blocks are hashed from the file.
+    int bcachefd = -1;
+    const hasher::B2H pendinghash{0, 0, 0, 0};
+
+    for (const auto &[blockno, block] : deltafile.blocks)
+    {
+        hasher::B2H hash = block.hash;
+        if (!restored && hash == pendinghash && compute_cachedblockhash(hash, bcachefd, blockno, block, deltafile.blocksize, deltafile.cachefile) == -1)
         {
-            std::cerr << errno << ": Read failed " << bindexfile << '\n';
+            if (bcachefd != -1)
+                close(bcachefd);
             return -1;
         }
 
-        infile.close();
+        idxmap.try_emplace(blockno, hash);
     }
 
+    if (bcachefd != -1)
+        close(bcachefd);
+
     return 0;
 }
 
+/**
+ * Fills in the block hashes and the file hash of a file. Instantiated per block size of the file.
+ * @param hashes Array to fill. Slot 0 is for the file hash.
+ * @param bindex Changed blocks of the file. Block ids are in the delta block size of the file.
+ * @param deltablocksize Block size the changed blocks were preserved with.
+ * @param basehashes Block hashes (of the same block size) of the file before the changes. NULL to rehash all the blocks.
+ * @return 0 on successful execution. -1 on failure.
+ */
+template <size_t BS>
 int hashmap_builder::update_hashes(
-    hasher::B2H *hashes, const off_t hashes_size, const std::string &relpath, const int orifd,
-    const uint32_t blockcount, const std::map<uint32_t, hasher::B2H> &bindex, const std::vector<char> &bhmapdata)
+    hasher::B2H *hashes, const off_t hashes_size, const std::string &relpath, const int orifd, const uint32_t blockcount,
+    const std::map<uint32_t, hasher::B2H> &bindex, const uint32_t deltablocksize, const std::vector<char> *basehashes)
 {
-    // If both existing delta block index and block hash map is available, we can just overlay the
-    // changed block hashes (mentioned in the delta block index) on top of the old block hashes.
-    if (!bhmapdata.empty() && !bindex.empty())
+    // If the original block hashes are available, we can just overlay the changed block hashes
+    // (mentioned in the delta block index) on top of the old block hashes.
+    if (basehashes != NULL && !basehashes->empty())
     {
         // Load old hashes.
-        memcpy(hashes, bhmapdata.data(), hashes_size < bhmapdata.size() ? hashes_size : bhmapdata.size());
+        memcpy(hashes, basehashes->data(), hashes_size < (off_t)basehashes->size() ? hashes_size : basehashes->size());
 
-        // Refer to the block index and rehash the changed blocks.
-        for (const auto [blockid, oldhash] : bindex)
+        // Refer to the block index and rehash the blocks covering the changed blocks.
+        uint32_t nextblockid = 0;
+        for (const auto [deltablockid, oldhash] : bindex)
         {
-            if (compute_blockhash(hashes[blockid + 1], blockid, orifd, relpath) == -1)
+            const uint64_t deltaoffset = (uint64_t)deltablockid * deltablocksize;
+            const uint32_t lastblockid = std::min<uint64_t>((deltaoffset + deltablocksize - 1) / BS, (uint64_t)blockcount - 1);
+            for (uint32_t blockid = std::max<uint64_t>(deltaoffset / BS, nextblockid); blockid < blockcount && blockid <= lastblockid; blockid++)
+            {
+                if (compute_blockhash<BS>(hashes[blockid + 1], blockid, orifd, relpath) == -1)
+                    return -1;
+            }
+            nextblockid = lastblockid + 1;
+        }
+
+        // Blocks beyond the base file are not in the block index. The last base block is rehashed as well
+        // since it may have been a partial block which got extended.
+        const uint32_t base_blockcount = basehashes->size() / hasher::HASH_SIZE - 1;
+        for (uint32_t blockid = base_blockcount > 0 ? base_blockcount - 1 : 0; blockid < blockcount; blockid++)
+        {
+            if (compute_blockhash<BS>(hashes[blockid + 1], blockid, orifd, relpath) == -1)
                 return -1;
         }
     }
@@ -173,7 +267,7 @@ int hashmap_builder::update_hashes(
         //block index is empty. So we need to rehash the entire file.
         for (uint32_t blockid = 0; blockid < blockcount; blockid++)
         {
-            if (compute_blockhash(hashes[blockid + 1], blockid, orifd, relpath) == -1)
+            if (compute_blockhash<BS>(hashes[blockid + 1], blockid, orifd, relpath) == -1)
                 return -1;
         }
     }
@@ -191,21 +285,60 @@ int hashmap_builder::update_hashes(
     return 0;
 }
 
+int hashmap_builder::compute_cachedblockhash(
+    hasher::B2H &hash, int &bcachefd, const uint32_t blockid, const delta_block &block, const uint32_t blocksize, const std::string &cachefile)
+{
+    if (bcachefd == -1)
+    {
+        bcachefd = open(cachefile.c_str(), O_RDONLY);
+        if (bcachefd == -1)
+        {
+            std::cerr << errno << ": Open failed " << cachefile << '\n';
+            return -1;
+        }
+    }
+
+    blockbuf.resize(blocksize);
+    const off_t blockoffset = (off_t)blocksize * blockid;
+    if (read_delta_block(bcachefd, block, blockbuf.data(), blocksize) == -1)
+    {
+        std::cerr << errno << ": Read failed " << cachefile << '\n';
+        return -1;
+    }
+
+    hash = hasher::hash(&blockoffset, 8, blockbuf.data(), blocksize);
+    return 0;
+}
+
+template <size_t BS>
 int hashmap_builder::compute_blockhash(hasher::B2H &hash, uint32_t blockid, int filefd, const std::string &relpath)
 {
-    char block[BLOCK_SIZE];
-    const off_t blockoffset = BLOCK_SIZE * blockid;
-    if (pread(filefd, block, BLOCK_SIZE, blockoffset) == -1)
+    if (blockbuf.size() < BS)
+        blockbuf.resize(BS);
+
+    const off_t blockoffset = (off_t)BS * blockid;
+    if (holes && holes->is_hole(blockoffset, BS))
+    {
+        hash = hasher::hash(&blockoffset, 8, ZERO_BLOCK, BS);
+        return 0;
+    }
+
+    const ssize_t res = pread(filefd, blockbuf.data(), BS, blockoffset);
+    if (res == -1)
     {
         std::cerr << errno << ": Read failed " << relpath << '\n';
         return -1;
     }
 
-    hash = hasher::hash(&blockoffset, 8, block, BLOCK_SIZE);
+    // Last block of the file may be partial. It is hashed padded with zeros.
+    if ((size_t)res < BS)
+        memset(blockbuf.data() + res, 0, BS - res);
+
+    hash = hasher::hash(&blockoffset, 8, blockbuf.data(), BS);
     return 0;
 }
 
-int hashmap_builder::write_blockhashmap(const std::string &bhmapfile, const hasher::B2H *hashes, const off_t hashes_size)
+int hashmap_builder::write_blockhashmap(const std::string &bhmapfile, const uint32_t blocksize, const hasher::B2H *hashes, const off_t hashes_size)
 {
     int hmapfd = open(bhmapfile.c_str(), O_RDWR | O_TRUNC | O_CREAT, FILE_PERMS);
     if (hmapfd == -1)
@@ -214,12 +347,17 @@ int hashmap_builder::write_blockhashmap(const std::string &bhmapfile, const hash
         return -1;
     }
 
-    // Write the updated hash list into the block hash map file.
-    if (pwrite(hmapfd, hashes, hashes_size, 0) == -1)
+    // Write the header and the updated hash list into the block hash map file.
+    const uint32_t header[2] = {HASHMAP_MAGIC, blocksize};
+    if (pwrite(hmapfd, header, HASHMAP_HEADER_SIZE, 0) == -1 || pwrite(hmapfd, hashes, hashes_size, HASHMAP_HEADER_SIZE) == -1)
     {
         std::cerr << errno << ": Write failed " << bhmapfile << '\n';
+        close(hmapfd);
         return -1;
     }
+
+    close(hmapfd);
+    return 0;
 }
 
 int hashmap_builder::update_hashtree_entry(hasher::B2H &parentdirhash, const bool oldbhmap_exists, const hasher::B2H oldfilehash, const hasher::B2H newfilehash, const std::string &bhmapfile, const std::string &relpath)
@@ -271,8 +409,11 @@ int hashmap_builder::remove_hashmapfile(hasher::B2H &parentdirhash, const std::s
             return -1;
         }
 
+        // The file hash is right after the header if there is one.
         hasher::B2H filehash;
-        if (read(hmapfd, &filehash, hasher::HASH_SIZE) == -1)
+        const off_t size = lseek(hmapfd, 0, SEEK_END);
+        const off_t hashoffset = size % hasher::HASH_SIZE == HASHMAP_HEADER_SIZE ? HASHMAP_HEADER_SIZE : 0;
+        if (pread(hmapfd, &filehash, hasher::HASH_SIZE, hashoffset) == -1)
         {
             std::cerr << errno << ": Read failed " << bhmapfile << '\n';
             return -1;
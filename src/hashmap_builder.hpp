@@ -5,31 +5,60 @@
 #include <list>
 #include <map>
 #include <vector>
+#include <optional>
 #include <unordered_set>
+#include <unordered_map>
 #include "hasher.hpp"
 #include "state_common.hpp"
+#include "delta_manifest.hpp"
 
 namespace statefs
 {
 
+// Block hash map format: [magic(4 bytes) | block size(4 bytes)] followed by the file hash and the block hashes.
+// Hash maps without the header are of the default block size.
+constexpr uint32_t HASHMAP_MAGIC = 0x4d484653; // "SFHM"
+constexpr size_t HASHMAP_HEADER_SIZE = 8;
+
+// Contents of a block hash map file.
+struct block_hashmap
+{
+    uint32_t blocksize = BLOCK_SIZE;
+    std::vector<char> hashes; // File hash followed by the block hashes. Empty if there is no hash map.
+};
+
 class hashmap_builder
 {
 private:
     const statedir_context &ctx;
+    const delta_manifest &deltamanifest;
+    // Whether the data files were restored back to the session start state using the delta.
+    const bool restored;
     // List of new block hash map sub directories created during the session.
     std::unordered_set<std::string> created_bhmapsubdirs;
+    // Renamed file path-->block hash map of the file at its previous path.
+    std::unordered_map<std::string, block_hashmap> renamedhashmaps;
+    // Buffer to read blocks being hashed.
+    std::vector<char> blockbuf;
+    // Holes of the file being hashed if it is sparse.
+    std::optional<hole_scanner> holes;
 
-    int read_blockhashmap(std::vector<char> &bhmapdata, std::string &hmapfile, const std::string &relpath);
-    int get_blockindex(std::map<uint32_t, hasher::B2H> &idxmap, uint32_t &blockcount, const std::string &filerelpath);
+    int read_blockhashmap(block_hashmap &bhmap, std::string &hmapfile, const std::string &relpath);
+    int get_blockindex(std::map<uint32_t, hasher::B2H> &idxmap, const delta_file &deltafile);
+    template <size_t BS>
     int update_hashes(
-        hasher::B2H *hashes, const off_t hashes_size, const std::string &relpath, const int orifd,
-        const uint32_t blockcount, const std::map<uint32_t, hasher::B2H> &bindex, const std::vector<char> &bhmapdata);
+        hasher::B2H *hashes, const off_t hashes_size, const std::string &relpath, const int orifd, const uint32_t blockcount,
+        const std::map<uint32_t, hasher::B2H> &bindex, const uint32_t deltablocksize, const std::vector<char> *basehashes);
+    int compute_cachedblockhash(
+        hasher::B2H &hash, int &bcachefd, const uint32_t blockid, const delta_block &block, const uint32_t blocksize, const std::string &cachefile);
+    template <size_t BS>
     int compute_blockhash(hasher::B2H &hash, uint32_t blockid, int filefd, const std::string &relpath);
-    int write_blockhashmap(const std::string &bhmapfile, const hasher::B2H *hashes, const off_t hashes_size);
+    int write_blockhashmap(const std::string &bhmapfile, const uint32_t blocksize, const hasher::B2H *hashes, const off_t hashes_size);
     int update_hashtree_entry(hasher::B2H &parentdirhash, const bool oldbhmap_exists, const hasher::B2H oldfilehash, const hasher::B2H newfilehash, const std::string &bhmapfile, const std::string &relpath);
 
 public:
-    hashmap_builder(const statedir_context &ctx);
+    hashmap_builder(const statedir_context &ctx, const delta_manifest &deltamanifest, const bool restored);
+    int load_renamedhashmaps();
     int generate_hashmap_forfile(hasher::B2H &parentdirhash, const std::string &filepath);
     int remove_hashmapfile(hasher::B2H &parentdirhash, const std::string &filepath);
 };
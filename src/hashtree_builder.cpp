@@ -4,21 +4,47 @@
 #include <fcntl.h>
 #include <boost/filesystem.hpp>
 #include "hashtree_builder.hpp"
-#include "state_restore.hpp"
 #include "state_common.hpp"
 
 namespace statefs
 {
 
-hashtree_builder::hashtree_builder(const statedir_context &ctx) : ctx(ctx), hmapbuilder(ctx)
+hashtree_builder::hashtree_builder(const statedir_context &ctx, const bool restored) : ctx(ctx), hmapbuilder(ctx, deltamanifest, restored)
 {
 }
 
 int hashtree_builder::generate()
 {
     // Load modified file path hints if available.
-    populate_hintpaths(IDX_TOUCHEDFILES);
-    populate_hintpaths(IDX_NEWFILES);
+    delta_manifest manifest;
+    if (read_delta_manifest(manifest, ctx.deltadir) != 0)
+        return -1;
+    for (const delta_rename &rename : manifest.renames)
+    {
+        add_hintpath(rename.from);
+        add_hintpath(rename.to);
+    }
+    populate_hintpaths();
+
+    return generate(std::move(manifest), {});
+}
+
+/**
+ * Updates the hash tree for the changes described by the given delta instead of the one in the delta dir.
+ * @param manifest Preserved state of the touched files.
+ * @param hints Other paths which may have changed (eg. renamed or new files).
+ * @return 0 on successful execution. -1 on failure.
+ */
+int hashtree_builder::generate(delta_manifest &&manifest, const std::vector<std::string> &hints)
+{
+    deltamanifest = std::move(manifest);
+    for (const delta_file &file : deltamanifest.files)
+        add_hintpath(file.relpath);
+    for (const std::string &hint : hints)
+        add_hintpath(hint);
+
+    if (hmapbuilder.load_renamedhashmaps() != 0)
+        return -1;
     hintmode = !hintpaths.empty();
 
     traversel_rootdir = ctx.datadir;
@@ -206,18 +232,19 @@ int hashtree_builder::process_file(hasher::B2H &parentdirhash, const std::string
     return 0;
 }
 
-void hashtree_builder::populate_hintpaths(const char *const idxfile)
+void hashtree_builder::populate_hintpaths()
 {
-    std::ifstream infile(std::string(ctx.deltadir).append(idxfile));
-    if (!infile.fail())
-    {
-        for (std::string relpath; std::getline(infile, relpath);)
-        {
-            std::string parentdir = boost::filesystem::path(relpath).parent_path().string();
-            hintpaths[parentdir].emplace(relpath);
-        }
-        infile.close();
-    }
+    // New files are read from the index and the new files log left by a session which did not close its delta.
+    std::unordered_set<std::string> newfiles;
+    read_newfiles(newfiles, ctx.deltadir);
+    for (const std::string &relpath : newfiles)
+        add_hintpath(relpath);
+}
+
+void hashtree_builder::add_hintpath(const std::string &relpath)
+{
+    std::string parentdir = boost::filesystem::path(relpath).parent_path().string();
+    hintpaths[parentdir].emplace(relpath);
 }
 
 bool hashtree_builder::get_hinteddir_match(hintpath_map::iterator &matchitr, const std::string &dirpath)
@@ -247,69 +274,3 @@ bool hashtree_builder::get_hinteddir_match(hintpath_map::iterator &matchitr, con
 }
 
 } // namespace statefs
-
-int main(int argc, char *argv[])
-{
-    if (argc == 2)
-    {
-        std::string arg1 = argv[1];
-        if (arg1.find(".bhmap") != std::string::npos)
-        {
-            std::string file = realpath(argv[1], NULL);
-            int fd = open(file.c_str(), O_RDONLY);
-
-            // Print the first 4 hashes in bhmap file.
-            hasher::B2H hash[4];
-            int res = read(fd, hash, 128);
-            for (int i = 0; i < 4; i++)
-                std::cout << std::hex << hash[i] << "\n";
-            close(fd);
-        }
-        else if (arg1.find("dir.hash") != std::string::npos)
-        {
-            std::string file = realpath(argv[1], NULL);
-            int fd = open(file.c_str(), O_RDONLY);
-
-            // Print dir hash.
-            hasher::B2H hash;
-            int res = read(fd, &hash, 32);
-            std::cout << std::hex << hash << "\n";
-            close(fd);
-        }
-        else
-        {
-            statefs::statedir_context ctx = statefs::init(argv[1]);
-            statefs::hashtree_builder builder(ctx);
-            if (builder.generate() == -1)
-                std::cerr << "Generation failed\n";
-
-            // Print root hash.
-            int fd = open(std::string(ctx.hashtreedir).append("/dir.hash").c_str(), O_RDONLY);
-            hasher::B2H hash;
-            int res = read(fd, &hash, 32);
-            std::cout << "State hash: " << std::hex << hash << "\n";
-            close(fd);
-        }
-
-        std::cout << "Done.\n";
-    }
-    else if (argc == 3 && std::string(argv[1]) == "restore")
-    {
-        statefs::statedir_context dirctx = statefs::init(argv[2]);
-        statefs::state_restore staterestore;
-        if (staterestore.rollback() == -1)
-            std::cerr << "Rollback failed.\n";
-
-        // Print root hash.
-        int fd = open(std::string(dirctx.hashtreedir).append("/dir.hash").c_str(), O_RDONLY);
-        hasher::B2H hash;
-        int res = read(fd, &hash, 32);
-        std::cout << "State hash: " << std::hex << hash << "\n";
-        close(fd);
-    }
-    else
-    {
-        std::cerr << "Incorrect arguments.\n";
-        exit(1);
-    }
-}
\ No newline at end of file
@@ -2,8 +2,10 @@
 #define _STATEFS_HASHTREE_BUILDER_
 
 #include <unordered_set>
+#include <vector>
 #include "hasher.hpp"
 #include "hashmap_builder.hpp"
+#include "delta_manifest.hpp"
 #include "state_common.hpp"
 
 namespace statefs
@@ -15,6 +17,7 @@ class hashtree_builder
 {
 private:
     const statedir_context &ctx;
+    delta_manifest deltamanifest; // Preserved state of the files touched in the session.
     hashmap_builder hmapbuilder;
 
     // Hint path map with parent dir as key and list of file paths under each parent dir.
@@ -35,12 +38,14 @@ private:
     bool should_process_file(const hintpath_map::iterator hintdir_itr, const std::string filepath);
     int process_file(hasher::B2H &parentdirhash, const std::string &filepath, const std::string &htreedirpath);
     int update_hashtree_entry(hasher::B2H &parentdirhash, const bool oldbhmap_exists, const hasher::B2H oldfilehash, const hasher::B2H newfilehash, const std::string &bhmapfile, const std::string &relpath);
-    void populate_hintpaths(const char *const idxfile);
+    void populate_hintpaths();
+    void add_hintpath(const std::string &relpath);
     bool get_hinteddir_match(hintpath_map::iterator &matchitr, const std::string &dirpath);
 
 public:
-    hashtree_builder(const statedir_context &ctx);
+    hashtree_builder(const statedir_context &ctx, const bool restored = false);
     int generate();
+    int generate(delta_manifest &&manifest, const std::vector<std::string> &hints);
 };
 
 } // namespace statefs
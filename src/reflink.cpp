@@ -0,0 +1,74 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#undef BLOCK_SIZE // linux/fs.h defines its own. We use the one in state_common.
+#include "state_common.hpp"
+#include "reflink.hpp"
+
+namespace statefs
+{
+
+/**
+ * Checks whether extents can be shared (reflinked) from files in one dir to files in another. Both dirs need to
+ * be on the same file system and it must support reflinks. We clone a block between temporary files in the dirs.
+ * @param srcdir Dir on the file system of the files being cloned.
+ * @param destdir Dir the clones are written to.
+ * @return True if reflinks are supported. False otherwise.
+ */
+bool probe_reflink(const std::string &srcdir, const std::string &destdir)
+{
+    std::string srcpath = srcdir + "/.reflinkprobe.XXXXXX";
+    const int srcfd = mkstemp(srcpath.data());
+    if (srcfd == -1)
+        return false;
+
+    std::string destpath = destdir + "/.reflinkprobe.XXXXXX";
+    const int destfd = mkstemp(destpath.data());
+
+    bool supported = false;
+    if (destfd != -1)
+    {
+        char block[BLOCK_SIZE];
+        memset(block, 0, BLOCK_SIZE);
+        supported = write(srcfd, block, BLOCK_SIZE) == BLOCK_SIZE &&
+                    clone_range(srcfd, 0, destfd, 0, BLOCK_SIZE) == 0;
+
+        close(destfd);
+        unlink(destpath.c_str());
+    }
+
+    close(srcfd);
+    unlink(srcpath.c_str());
+    return supported;
+}
+
+/**
+ * Makes the destination file range share the extents of the source file range instead of copying bytes.
+ * Offsets and length must be aligned to the file system block size, except for a range ending at source EOF.
+ * @return 0 on success. -1 on failure with errno set.
+ */
+int clone_range(const int srcfd, const off_t srcoffset, const int destfd, const off_t destoffset, const size_t length)
+{
+    struct file_clone_range range;
+    range.src_fd = srcfd;
+    range.src_offset = srcoffset;
+    range.src_length = length;
+    range.dest_offset = destoffset;
+    return ioctl(destfd, FICLONERANGE, &range);
+}
+
+/**
+ * Returns whether a clone_range() error means that the file system cannot reflink at all
+ * (as opposed to the particular range being unsuitable).
+ */
+bool is_reflink_unsupported_error(const int err)
+{
+    return err == EOPNOTSUPP || err == ENOTTY || err == EXDEV || err == ENOSYS;
+}
+
+} // namespace statefs
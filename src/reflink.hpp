@@ -0,0 +1,16 @@
+#ifndef _STATEFS_REFLINK_
+#define _STATEFS_REFLINK_
+
+#include <sys/types.h>
+#include <string>
+
+namespace statefs
+{
+
+bool probe_reflink(const std::string &srcdir, const std::string &destdir);
+int clone_range(const int srcfd, const off_t srcoffset, const int destfd, const off_t destoffset, const size_t length);
+bool is_reflink_unsupported_error(const int err);
+
+} // namespace statefs
+
+#endif
@@ -1,4 +1,12 @@
+#include <iostream>
+#include <fstream>
 #include <string>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <boost/filesystem.hpp>
 #include "state_common.hpp"
 
@@ -7,18 +15,162 @@ namespace statefs
 
 std::string statehistdir;
 
+alignas(64) const char ZERO_BLOCK[LARGE_BLOCK_SIZE] = {};
+
+void migrate_checkpoints();
+
 statedir_context init(const std::string &statehist_dir_root)
 {
     // Initialize 0 state (current state) directory and return the directory context for it.
     statehistdir = realpath(statehist_dir_root.c_str(), NULL);
+    if (!boost::filesystem::exists(statehistdir + CHECKPOINTS_FNAME))
+        migrate_checkpoints();
     return get_statedir_context(0, true);
 } // namespace statefs
 
+/**
+ * Moves the deltas of the old layout, where each checkpoint had its own dir shifted along with every new
+ * checkpoint (0, -1, -2...), into generation dirs and writes the checkpoints file. A fresh state history
+ * dir starts at the first generation.
+ */
+void migrate_checkpoints()
+{
+    int16_t oldest_chkpnt = 0;
+    while (oldest_chkpnt > INT16_MIN + 1 && boost::filesystem::exists(get_statedir_root(oldest_chkpnt - 1) + DELTA_DIR))
+        oldest_chkpnt--;
+
+    checkpoint_window window;
+    window.current = 1 - oldest_chkpnt;
+    window.next = window.current + 1;
+    boost::filesystem::create_directories(statehistdir + DELTAS_DIR);
+
+    for (int16_t chkpnt = oldest_chkpnt; chkpnt <= 0; chkpnt++)
+    {
+        const std::string deltadir = get_statedir_root(chkpnt) + DELTA_DIR;
+        if (!boost::filesystem::exists(deltadir))
+            continue;
+
+        boost::filesystem::rename(deltadir, get_generation_deltadir(window.current + chkpnt));
+        if (chkpnt < 0)
+            boost::filesystem::remove_all(get_statedir_root(chkpnt));
+    }
+
+    write_checkpoint_window(window);
+}
+
+/**
+ * Reads the live window of checkpoint generations.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int read_checkpoint_window(checkpoint_window &window)
+{
+    const std::string checkpointsfile = statehistdir + CHECKPOINTS_FNAME;
+    std::ifstream infile(checkpointsfile, std::ios::binary);
+    char buf[CHECKPOINTS_FILE_SIZE];
+    if (!infile.read(buf, CHECKPOINTS_FILE_SIZE))
+    {
+        std::cerr << errno << ": Read failed " << checkpointsfile << "\n";
+        return -1;
+    }
+
+    uint32_t magic = 0, version = 0;
+    memcpy(&magic, buf, 4);
+    memcpy(&version, buf + 4, 4);
+    if (magic != CHECKPOINTS_MAGIC || version > CHECKPOINTS_VERSION)
+    {
+        std::cerr << "Unsupported checkpoints file " << checkpointsfile << "\n";
+        return -1;
+    }
+
+    memcpy(&window.current, buf + 8, 8);
+    memcpy(&window.oldest, buf + 16, 8);
+    memcpy(&window.next, buf + 24, 8);
+    return 0;
+}
+
+/**
+ * Replaces the checkpoints file with the given window. The new file is renamed over the old one so the
+ * window moves atomically.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int write_checkpoint_window(const checkpoint_window &window)
+{
+    char buf[CHECKPOINTS_FILE_SIZE];
+    memcpy(buf, &CHECKPOINTS_MAGIC, 4);
+    memcpy(buf + 4, &CHECKPOINTS_VERSION, 4);
+    memcpy(buf + 8, &window.current, 8);
+    memcpy(buf + 16, &window.oldest, 8);
+    memcpy(buf + 24, &window.next, 8);
+
+    const std::string checkpointsfile = statehistdir + CHECKPOINTS_FNAME;
+    const std::string tmpfile = checkpointsfile + ".tmp";
+    const int fd = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMS);
+    if (fd == -1)
+    {
+        std::cerr << errno << ": Open failed " << tmpfile << "\n";
+        return -1;
+    }
+
+    const bool written = write(fd, buf, CHECKPOINTS_FILE_SIZE) == CHECKPOINTS_FILE_SIZE && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(tmpfile.c_str(), checkpointsfile.c_str()) == -1)
+    {
+        std::cerr << errno << ": Write failed " << checkpointsfile << "\n";
+        return -1;
+    }
+
+    return 0;
+}
+
+std::string get_generation_deltadir(const uint64_t generation)
+{
+    return statehistdir + DELTAS_DIR + "/" + std::to_string(generation);
+}
+
+/**
+ * Returns the generations which have a delta dir, in ascending order. This includes expired generations
+ * which are not deleted yet.
+ */
+std::vector<uint64_t> list_generations()
+{
+    std::vector<uint64_t> generations;
+    const boost::filesystem::directory_iterator itrend;
+    for (boost::filesystem::directory_iterator itr(statehistdir + DELTAS_DIR); itr != itrend; itr++)
+    {
+        const std::string name = itr->path().filename().string();
+        if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos)
+            generations.push_back(std::stoull(name));
+    }
+
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+/**
+ * Returns the generations within the given window which have a delta dir, in ascending order.
+ * The current generation is the last one.
+ */
+std::vector<uint64_t> list_live_generations(const checkpoint_window &window)
+{
+    std::vector<uint64_t> generations = list_generations();
+    generations.erase(std::remove_if(generations.begin(), generations.end(), [&](const uint64_t generation) {
+                          return generation < window.oldest || generation > window.current;
+                      }),
+                      generations.end());
+    return generations;
+}
+
 std::string get_statedir_root(const int16_t checkpointid)
 {
     return statehistdir + "/" + std::to_string(checkpointid);
 }
 
+/**
+ * Returns the dirs of the state at the given checkpoint. The current state is checkpoint 0 and earlier
+ * checkpoints count down from there. Only the current state has data dirs. The delta dir of a checkpoint
+ * is the one of its generation. It is left empty if the checkpoints file cannot be read or the checkpoint
+ * is not retained.
+ */
 statedir_context get_statedir_context(const int16_t checkpointid, const bool createdirs)
 {
     statedir_context ctx;
@@ -26,7 +178,23 @@ statedir_context get_statedir_context(const int16_t checkpointid, const bool cre
     ctx.datadir = ctx.rootdir + DATA_DIR;
     ctx.blockhashmapdir = ctx.rootdir + BHMAP_DIR;
     ctx.hashtreedir = ctx.rootdir + HTREE_DIR;
-    ctx.deltadir = ctx.rootdir + DELTA_DIR;
+
+    checkpoint_window window;
+    if (checkpointid <= 0 && read_checkpoint_window(window) == 0)
+    {
+        // Rolled back generations leave gaps in the nos. So earlier checkpoints are counted through the live generations.
+        std::vector<uint64_t> earlier = list_live_generations(window);
+        if (!earlier.empty() && earlier.back() == window.current)
+            earlier.pop_back();
+
+        const size_t back = -(int32_t)checkpointid;
+        if (back == 0)
+            ctx.deltadir = get_generation_deltadir(window.current);
+        else if (back <= earlier.size())
+            ctx.deltadir = get_generation_deltadir(earlier[earlier.size() - back]);
+    }
+    if (ctx.deltadir.empty())
+        std::cerr << "Checkpoint " << checkpointid << " is not retained in " << statehistdir << "\n";
 
     if (createdirs)
     {
@@ -36,7 +204,7 @@ statedir_context get_statedir_context(const int16_t checkpointid, const bool cre
             boost::filesystem::create_directories(ctx.blockhashmapdir);
         if (!boost::filesystem::exists(ctx.hashtreedir))
             boost::filesystem::create_directories(ctx.hashtreedir);
-        if (!boost::filesystem::exists(ctx.deltadir))
+        if (!ctx.deltadir.empty() && !boost::filesystem::exists(ctx.deltadir))
             boost::filesystem::create_directories(ctx.deltadir);
     }
 
@@ -56,4 +224,76 @@ std::string switch_basepath(const std::string &fullpath, const std::string &from
     return to_base_path + get_relpath(fullpath, from_base_path);
 }
 
+/**
+ * Returns the block size used for a file of the given length. Larger files get larger blocks.
+ */
+uint32_t get_blocksize(const off_t filelength)
+{
+    if (filelength >= LARGE_BLOCK_TIER)
+        return LARGE_BLOCK_SIZE;
+    else if (filelength >= MEDIUM_BLOCK_TIER)
+        return MEDIUM_BLOCK_SIZE;
+    else
+        return BLOCK_SIZE;
+}
+
+bool is_valid_blocksize(const uint32_t blocksize)
+{
+    return blocksize == BLOCK_SIZE || blocksize == MEDIUM_BLOCK_SIZE || blocksize == LARGE_BLOCK_SIZE;
+}
+
+/**
+ * Parses a decimal option value which must be within the given range.
+ * @return 0 on successful execution. -1 if the value is not a number or is out of range.
+ */
+int parse_number(uint64_t &number, const std::string &value, const uint64_t min, const uint64_t max)
+{
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos)
+        return -1;
+
+    errno = 0;
+    number = strtoull(value.c_str(), NULL, 10);
+    return (errno == ERANGE || number < min || number > max) ? -1 : 0;
+}
+
+/**
+ * Returns whether a block is all zeros. The block is compared against itself shifted by one byte so the
+ * check runs through the vectorized memcmp of the C library.
+ */
+bool is_zero_block(const char *data, const size_t length)
+{
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+/**
+ * Returns whether the given range of the file lies entirely within a hole. The range beyond EOF is a hole.
+ */
+bool hole_scanner::is_hole(const off_t offset, const size_t length)
+{
+    if (offset < extentstart || offset >= extentend)
+    {
+        extentstart = offset;
+        const off_t datastart = lseek(fd, offset, SEEK_DATA);
+        if (datastart == -1)
+        {
+            // No data after the offset. Otherwise holes cannot be told apart, so everything is data.
+            inhole = errno == ENXIO;
+            extentend = LLONG_MAX;
+        }
+        else if (datastart > offset)
+        {
+            inhole = true;
+            extentend = datastart;
+        }
+        else
+        {
+            inhole = false;
+            const off_t holestart = lseek(fd, offset, SEEK_HOLE);
+            extentend = holestart > offset ? holestart : LLONG_MAX;
+        }
+    }
+
+    return inhole && offset + (off_t)length <= extentend;
+}
+
 } // namespace statefs
\ No newline at end of file
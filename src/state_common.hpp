@@ -3,13 +3,24 @@
 
 #include <sys/types.h>
 #include <string>
+#include <vector>
+#include <type_traits>
 #include "hasher.hpp"
 
 namespace statefs
 {
 
-// Cache block size.
-constexpr size_t BLOCK_SIZE = 4 * 1024; //* 1024; // 4MB
+// Default cache block size. Also the smallest block size a file can have.
+constexpr size_t BLOCK_SIZE = 4 * 1024;
+
+// Larger block sizes for large files (eg. media, databases). These keep the no. of preserved blocks,
+// manifest records and block hashes of a large file down.
+constexpr size_t MEDIUM_BLOCK_SIZE = 64 * 1024;
+constexpr size_t LARGE_BLOCK_SIZE = 1024 * 1024;
+
+// File lengths from which the larger block sizes are used.
+constexpr off_t MEDIUM_BLOCK_TIER = 16 * 1024 * 1024;
+constexpr off_t LARGE_BLOCK_TIER = 1024 * 1024 * 1024;
 
 // Cache block index entry bytes length.
 constexpr size_t BLOCKINDEX_ENTRY_SIZE = 44;
@@ -28,14 +39,45 @@ const char *const BLOCKCACHE_EXT = ".bcache";
 constexpr size_t BLOCKCACHE_EXT_LEN = 7;
 
 const char *const IDX_NEWFILES = "/idxnew.idx";
+const char *const LOG_NEWFILES = "/idxnew.log";
 const char *const IDX_TOUCHEDFILES = "/idxtouched.idx";
+const char *const DELTA_SEGMENT_FNAME = "/segment.blk";
+const char *const DELTA_MANIFEST_FNAME = "/manifest.idx";
+const char *const DELTA_LINKS_DIR = "/links";
 const char *const DIRHASH_FNAME = "dir.hash";
 
+// Block store shared by the deltas of all checkpoints. Lives directly under the state history dir.
+const char *const BLOCKSTORE_DIR = "/blockstore";
+const char *const BLOCKSTORE_DATA_FNAME = "/blocks.blk";
+const char *const BLOCKSTORE_INDEX_FNAME = "/blocks.idx";
+
 const char *const DATA_DIR = "/data";
 const char *const BHMAP_DIR = "/bhmap";
 const char *const HTREE_DIR = "/htree";
 const char *const DELTA_DIR = "/delta";
 
+// Deltas of all the checkpoints live under the deltas dir, one dir per generation. The checkpoints file
+// names the live window of generations. Both are directly under the state history dir.
+const char *const DELTAS_DIR = "/deltas";
+const char *const CHECKPOINTS_FNAME = "/checkpoints.idx";
+
+// Unix socket of a running monitor through which checkpoints are requested. Directly under the state history dir.
+const char *const CONTROL_SOCKET_FNAME = "/statemon.sock";
+
+// Seconds the monitor waits for a connected client to send its command before dropping the connection.
+constexpr int CONTROL_RECV_TIMEOUT = 5;
+
+// Milliseconds the monitor waits with operations held off for a kernel call (syncfs, cache invalidation) which
+// may itself wait on a held off operation. After that the operations are let through so the call can complete.
+constexpr int KERNEL_WAIT_MS = 2000;
+
+// Checkpoints file format: [magic(4 bytes) | version(4 bytes) | current generation(8 bytes) | oldest generation(8 bytes) |
+//                           next generation(8 bytes)]
+constexpr uint32_t CHECKPOINTS_MAGIC = 0x50434653; // "SFCP"
+constexpr uint32_t CHECKPOINTS_VERSION = 1;
+constexpr size_t CHECKPOINTS_FILE_SIZE = 32;
+
+// Default no. of earlier checkpoints retained. One more is kept in case of rollbacks.
 constexpr int16_t MAX_CHECKPOINTS = 5;
 
 extern std::string statehistdir;
@@ -49,11 +91,67 @@ struct statedir_context
     std::string deltadir;
 };
 
+// Live window of checkpoint generations. Generation nos. only go up, so a checkpoint is created by
+// moving the window rather than renaming the dirs of all the earlier ones. Rolled back generations are
+// never reissued, so the live generations may have gaps.
+struct checkpoint_window
+{
+    uint64_t current = 1; // Generation whose delta the current session writes to.
+    uint64_t oldest = 1;  // Oldest retained generation. Older ones are expired and deleted lazily.
+    uint64_t next = 2;    // Generation no. the next session gets. Only goes up, even when the window moves back.
+};
+
 statedir_context init(const std::string &statehist_dir_root);
+int read_checkpoint_window(checkpoint_window &window);
+int write_checkpoint_window(const checkpoint_window &window);
+std::string get_generation_deltadir(const uint64_t generation);
+std::vector<uint64_t> list_generations();
+std::vector<uint64_t> list_live_generations(const checkpoint_window &window);
 std::string get_statedir_root(const int16_t checkpointid);
 statedir_context get_statedir_context(int16_t checkpointid = 0, bool createdirs = false);
 std::string get_relpath(const std::string &fullpath, const std::string &base_path);
 std::string switch_basepath(const std::string &fullpath, const std::string &from_base_path, const std::string &to_base_path);
+uint32_t get_blocksize(const off_t filelength);
+bool is_valid_blocksize(const uint32_t blocksize);
+int parse_number(uint64_t &number, const std::string &value, const uint64_t min, const uint64_t max);
+bool is_zero_block(const char *data, const size_t length);
+
+// A block of zeros as long as the largest block size. Hole blocks are hashed from this without reading them.
+extern const char ZERO_BLOCK[LARGE_BLOCK_SIZE];
+
+// Tells the holes of a sparse file apart from its data while scanning the file. Each lookup remembers the
+// hole or data extent it lands in, so a scan costs a couple of lseek calls per extent rather than per block.
+// If the file system cannot report holes the whole file is treated as data.
+class hole_scanner
+{
+private:
+    const int fd;
+    off_t extentstart = 0, extentend = 0;
+    bool inhole = false;
+
+public:
+    hole_scanner(const int fd) : fd(fd) {}
+    bool is_hole(const off_t offset, const size_t length);
+};
+
+/**
+ * Invokes the given function with the block size as a compile time constant (std::integral_constant),
+ * so the per-block loops of each supported block size are compiled as if the block size was constexpr.
+ * Block sizes are validated when read so anything else is treated as the default block size.
+ */
+template <typename F>
+inline auto with_blocksize(const uint32_t blocksize, F &&func)
+{
+    switch (blocksize)
+    {
+    case MEDIUM_BLOCK_SIZE:
+        return func(std::integral_constant<size_t, MEDIUM_BLOCK_SIZE>());
+    case LARGE_BLOCK_SIZE:
+        return func(std::integral_constant<size_t, LARGE_BLOCK_SIZE>());
+    default:
+        return func(std::integral_constant<size_t, BLOCK_SIZE>());
+    }
+}
 
 } // namespace statefs
 
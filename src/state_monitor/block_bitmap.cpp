@@ -0,0 +1,130 @@
+#include "block_bitmap.hpp"
+
+namespace statefs
+{
+
+std::atomic<int64_t> block_bitmap::allocated_bytes{0};
+
+block_bitmap::~block_bitmap()
+{
+    release_words();
+}
+
+/**
+ * Clears the bitmap and sizes it for the given no. of blocks.
+ */
+void block_bitmap::reset(const uint32_t count)
+{
+    release_words();
+    blockcount = count;
+    setcount = 0;
+}
+
+/**
+ * Restores the bitmap from the state saved with size(), count() and get_words().
+ */
+void block_bitmap::assign(const uint32_t count, const uint32_t set, std::vector<uint64_t> &&savedwords)
+{
+    release_words();
+    blockcount = count;
+    setcount = set;
+    if (!full() && !empty())
+    {
+        words = std::move(savedwords);
+        allocated_bytes += memory_usage();
+    }
+}
+
+bool block_bitmap::test(const uint32_t blockid) const
+{
+    if (full())
+        return true;
+    if (words.empty())
+        return false;
+    return (words[blockid / 64] >> (blockid % 64)) & 1;
+}
+
+/**
+ * Marks the given block as set. Block id must be less than the bitmap size.
+ */
+void block_bitmap::set(const uint32_t blockid)
+{
+    if (test(blockid))
+        return;
+
+    if (words.empty())
+    {
+        words.resize((blockcount + 63) / 64, 0);
+        allocated_bytes += memory_usage();
+    }
+
+    words[blockid / 64] |= (uint64_t)1 << (blockid % 64);
+    setcount++;
+
+    // We no longer need the words once all the blocks are set.
+    if (full())
+        release_words();
+}
+
+/**
+ * Finds the first unset block within the inclusive range [first, last], skipping whole words at a time.
+ * @return The first unset block id. last + 1 if all the blocks in the range are set.
+ */
+uint32_t block_bitmap::find_first_unset(const uint32_t first, const uint32_t last) const
+{
+    if (full())
+        return last + 1;
+    if (words.empty())
+        return first;
+
+    uint32_t blockid = first;
+    while (blockid <= last)
+    {
+        // Inverted word with the bits below blockid masked out.
+        const uint64_t word = ~words[blockid / 64] & (~(uint64_t)0 << (blockid % 64));
+        if (word != 0)
+        {
+            const uint32_t found = (blockid & ~63u) + __builtin_ctzll(word);
+            return found <= last ? found : last + 1;
+        }
+        blockid = (blockid & ~63u) + 64;
+    }
+    return last + 1;
+}
+
+/**
+ * Finds the first set block within the inclusive range [first, last], skipping whole words at a time.
+ * @return The first set block id. last + 1 if none of the blocks in the range are set.
+ */
+uint32_t block_bitmap::find_first_set(const uint32_t first, const uint32_t last) const
+{
+    if (full())
+        return first;
+    if (words.empty())
+        return last + 1;
+
+    uint32_t blockid = first;
+    while (blockid <= last)
+    {
+        const uint64_t word = words[blockid / 64] & (~(uint64_t)0 << (blockid % 64));
+        if (word != 0)
+        {
+            const uint32_t found = (blockid & ~63u) + __builtin_ctzll(word);
+            return found <= last ? found : last + 1;
+        }
+        blockid = (blockid & ~63u) + 64;
+    }
+    return last + 1;
+}
+
+void block_bitmap::release_words()
+{
+    if (words.empty())
+        return;
+
+    allocated_bytes -= memory_usage();
+    words.clear();
+    words.shrink_to_fit();
+}
+
+} // namespace statefs
@@ -0,0 +1,52 @@
+#ifndef _STATEFS_BLOCK_BITMAP_
+#define _STATEFS_BLOCK_BITMAP_
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+namespace statefs
+{
+
+// Dense bitmap of the cached block ids of a file. It is sized to the original block count of the
+// file and the words are only allocated when the first block is set. Once every block is set, the
+// words are released and the bitmap is represented by the fully set flag alone.
+class block_bitmap
+{
+private:
+    // Total bytes allocated for bitmap words across all bitmaps.
+    static std::atomic<int64_t> allocated_bytes;
+
+    std::vector<uint64_t> words;
+    uint32_t blockcount = 0;
+    uint32_t setcount = 0;
+
+    void release_words();
+
+public:
+    block_bitmap() = default;
+    block_bitmap(const block_bitmap &) = delete;
+    block_bitmap &operator=(const block_bitmap &) = delete;
+    ~block_bitmap();
+
+    void reset(const uint32_t blockcount);
+    void assign(const uint32_t blockcount, const uint32_t setcount, std::vector<uint64_t> &&words);
+    bool test(const uint32_t blockid) const;
+    void set(const uint32_t blockid);
+    uint32_t find_first_unset(const uint32_t first, const uint32_t last) const;
+    uint32_t find_first_set(const uint32_t first, const uint32_t last) const;
+
+    uint32_t size() const { return blockcount; }
+    uint32_t count() const { return setcount; }
+    bool empty() const { return setcount == 0; }
+    bool full() const { return setcount == blockcount; }
+    size_t memory_usage() const { return words.capacity() * sizeof(uint64_t); }
+    const std::vector<uint64_t> &get_words() const { return words; }
+
+    static int64_t total_memory_usage() { return allocated_bytes; }
+};
+
+} // namespace statefs
+
+#endif
@@ -0,0 +1,326 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <boost/filesystem.hpp>
+#include "../state_common.hpp"
+#include "../delta_manifest.hpp"
+#include "block_store.hpp"
+
+namespace statefs
+{
+
+block_store::~block_store()
+{
+    if (datafd != -1)
+        close(datafd);
+    if (indexfd != -1)
+        close(indexfd);
+}
+
+/**
+ * Opens the store in the given dir, creating it if needed. Reference counts are rebuilt from the manifests
+ * of the given delta dirs and blocks nothing references any more are released. Does nothing if it is
+ * already open.
+ * @param storedir The block store dir.
+ * @param deltadirs Delta dirs of all the retained checkpoints.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::open(const std::string &storedir, const std::vector<std::string> &deltadirs)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (datafd != -1)
+        return 0;
+
+    dir = storedir;
+    boost::filesystem::create_directories(dir);
+
+    const std::string datafile = dir + BLOCKSTORE_DATA_FNAME;
+    datafd = ::open(datafile.c_str(), O_RDWR | O_CREAT, FILE_PERMS);
+    if (datafd == -1)
+    {
+        std::cerr << errno << ": Open failed " << datafile << "\n";
+        return -1;
+    }
+    datalength = lseek(datafd, 0, SEEK_END);
+
+    if (load_refs(deltadirs) == -1)
+    {
+        close(datafd);
+        datafd = -1;
+        entries.clear();
+        offsets.clear();
+        storedbytes = 0;
+        return -1;
+    }
+
+    for (auto itr = entries.begin(); itr != entries.end();)
+    {
+        const auto next = std::next(itr);
+        if (itr->second.refs == 0)
+            release_entry(itr->first);
+        itr = next;
+    }
+
+    return rewrite_index();
+}
+
+/**
+ * Reads the entries of the store index and counts the references to them in the manifests of the given delta dirs.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::load_refs(const std::vector<std::string> &deltadirs)
+{
+    std::vector<char> buf;
+    if (load_index(buf) == -1)
+        return -1;
+
+    // Blocks which made it into the store without their manifest records before an unclean exit
+    // end up with no references and are released along with the others.
+    for (const std::string &deltadir : deltadirs)
+    {
+        if (!boost::filesystem::exists(deltadir + DELTA_MANIFEST_FNAME))
+            continue;
+
+        delta_manifest manifest;
+        if (read_delta_manifest(manifest, deltadir) == -1)
+            return -1;
+
+        for (const off_t offset : manifest.storerefs)
+        {
+            const auto itr = entries.find(offset);
+            if (itr == entries.end())
+            {
+                std::cerr << "Block store has no block at " << offset << " referenced by " << deltadir << "\n";
+                return -1;
+            }
+            itr->second.refs++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the entries of the store index.
+ * @param buf Buffer to read the index into.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::load_index(std::vector<char> &buf)
+{
+    const std::string indexfile = dir + BLOCKSTORE_INDEX_FNAME;
+    if (!boost::filesystem::exists(indexfile))
+        return 0;
+
+    std::ifstream infile(indexfile, std::ios::binary | std::ios::ate);
+    const std::streamsize size = infile.tellg();
+    infile.seekg(0, std::ios::beg);
+
+    buf.resize(size);
+    if (!infile.read(buf.data(), size))
+    {
+        std::cerr << errno << ": Read failed " << indexfile << "\n";
+        return -1;
+    }
+
+    uint32_t magic = 0, version = 0;
+    if (size >= (std::streamsize)BLOCKSTORE_HEADER_SIZE)
+    {
+        memcpy(&magic, buf.data(), 4);
+        memcpy(&version, buf.data() + 4, 4);
+    }
+    if (magic != BLOCKSTORE_MAGIC || version > BLOCKSTORE_VERSION)
+    {
+        std::cerr << "Unsupported block store index " << indexfile << "\n";
+        return -1;
+    }
+
+    // A partially written entry at the end (eg. monitor did not exit cleanly) is ignored.
+    for (size_t pos = BLOCKSTORE_HEADER_SIZE; pos + BLOCKSTORE_ENTRY_SIZE <= buf.size(); pos += BLOCKSTORE_ENTRY_SIZE)
+    {
+        store_entry entry;
+        off_t offset = 0;
+        memcpy(&entry.contenthash, buf.data() + pos, hasher::HASH_SIZE);
+        memcpy(&offset, buf.data() + pos + 32, 8);
+        memcpy(&entry.storedlength, buf.data() + pos + 40, 4);
+        entry.codec = (block_codec)buf[pos + 44];
+        entry.refs = 0;
+
+        if (entries.try_emplace(offset, entry).second)
+        {
+            offsets[entry.contenthash] = offset;
+            storedbytes += entry.storedlength;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a compacted index holding only the live entries and switches over to it.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::rewrite_index()
+{
+    std::vector<char> buf(BLOCKSTORE_HEADER_SIZE + entries.size() * BLOCKSTORE_ENTRY_SIZE);
+    memcpy(buf.data(), &BLOCKSTORE_MAGIC, 4);
+    memcpy(buf.data() + 4, &BLOCKSTORE_VERSION, 4);
+
+    char *entryptr = buf.data() + BLOCKSTORE_HEADER_SIZE;
+    for (const auto &[offset, entry] : entries)
+    {
+        memcpy(entryptr, &entry.contenthash, hasher::HASH_SIZE);
+        memcpy(entryptr + 32, &offset, 8);
+        memcpy(entryptr + 40, &entry.storedlength, 4);
+        entryptr[44] = (char)entry.codec;
+        entryptr += BLOCKSTORE_ENTRY_SIZE;
+    }
+
+    const std::string indexfile = dir + BLOCKSTORE_INDEX_FNAME;
+    const std::string tmpfile = indexfile + ".tmp";
+    const int fd = ::open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMS);
+    if (fd == -1)
+    {
+        std::cerr << errno << ": Open failed " << tmpfile << "\n";
+        return -1;
+    }
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size() || rename(tmpfile.c_str(), indexfile.c_str()) == -1)
+    {
+        std::cerr << errno << ": Write failed " << indexfile << "\n";
+        close(fd);
+        return -1;
+    }
+
+    if (indexfd != -1)
+        close(indexfd);
+    indexfd = fd;
+    indexlength = buf.size();
+
+    // Nothing is left in the store. Start it over instead of leaving a long sparse file behind.
+    if (entries.empty() && datalength > 0)
+    {
+        if (ftruncate(datafd, 0) == -1)
+        {
+            std::cerr << errno << ": Truncate failed " << dir << BLOCKSTORE_DATA_FNAME << "\n";
+            return -1;
+        }
+        datalength = 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Keeps the given blocks in the store. Blocks already in the store only gain a reference. Others are
+ * appended to the store data file and indexed. Both ways each block holds one more reference.
+ * Nothing changes in the store if writing the new blocks fails.
+ * @param blocks The blocks. Their store offsets are filled in.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::add_blocks(std::vector<store_block> &blocks)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // New blocks are only indexed in memory once they are written. Identical blocks within the batch
+    // are stored once as well.
+    std::unordered_map<hasher::B2H, off_t, blake2b_hash> added;
+    std::vector<char> data, index;
+    off_t dataoffset = datalength;
+    for (store_block &block : blocks)
+    {
+        const auto itr = offsets.find(block.contenthash);
+        if (itr != offsets.end())
+        {
+            block.offset = itr->second;
+            block.duplicate = true;
+            continue;
+        }
+
+        const auto [addeditr, inserted] = added.try_emplace(block.contenthash, dataoffset);
+        block.offset = addeditr->second;
+        block.duplicate = !inserted;
+        if (!inserted)
+            continue;
+
+        data.insert(data.end(), block.data, block.data + block.storedlength);
+        dataoffset += block.storedlength;
+
+        const size_t pos = index.size();
+        index.resize(pos + BLOCKSTORE_ENTRY_SIZE);
+        memcpy(index.data() + pos, &block.contenthash, hasher::HASH_SIZE);
+        memcpy(index.data() + pos + 32, &block.offset, 8);
+        memcpy(index.data() + pos + 40, &block.storedlength, 4);
+        index[pos + 44] = (char)block.codec;
+    }
+
+    // The data goes in before its index entries so an indexed block is always readable.
+    if (!data.empty())
+    {
+        if (pwrite(datafd, data.data(), data.size(), datalength) != (ssize_t)data.size())
+        {
+            std::cerr << errno << ": Write to block store failed\n";
+            return -1;
+        }
+        if (pwrite(indexfd, index.data(), index.size(), indexlength) != (ssize_t)index.size())
+        {
+            std::cerr << errno << ": Write to block store index failed\n";
+            return -1;
+        }
+        datalength = dataoffset;
+        indexlength += index.size();
+    }
+
+    for (const store_block &block : blocks)
+    {
+        if (block.duplicate)
+        {
+            entries[block.offset].refs++;
+        }
+        else
+        {
+            offsets.emplace(block.contenthash, block.offset);
+            entries.emplace(block.offset, store_entry{block.contenthash, block.storedlength, block.codec, 1});
+            storedbytes += block.storedlength;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Drops one reference per given store offset. Blocks left with no references are released and
+ * the index is compacted.
+ * @param refs Store offsets referenced by the block records of a removed delta.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int block_store::release(const std::vector<off_t> &refs)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (refs.empty())
+        return 0;
+
+    for (const off_t offset : refs)
+    {
+        const auto itr = entries.find(offset);
+        if (itr != entries.end() && --itr->second.refs == 0)
+            release_entry(offset);
+    }
+
+    return rewrite_index();
+}
+
+/**
+ * Removes an entry and punches its block out of the store data file. If the file system cannot punch
+ * holes the bytes just stay unreferenced.
+ */
+void block_store::release_entry(const off_t offset)
+{
+    const auto itr = entries.find(offset);
+    fallocate(datafd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, itr->second.storedlength);
+    storedbytes -= itr->second.storedlength;
+    offsets.erase(itr->second.contenthash);
+    entries.erase(itr);
+}
+
+} // namespace statefs
@@ -0,0 +1,81 @@
+#ifndef _STATEFS_BLOCK_STORE_
+#define _STATEFS_BLOCK_STORE_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include "../hasher.hpp"
+#include "../block_codec.hpp"
+
+namespace statefs
+{
+
+// Store index format: [magic(4 bytes) | version(4 bytes)] followed by entries.
+// Entry: [content hash(32 bytes) | store offset(8 bytes) | stored length(4 bytes) | codec(1 byte)]
+constexpr uint32_t BLOCKSTORE_MAGIC = 0x53424653; // "SFBS"
+constexpr uint32_t BLOCKSTORE_VERSION = 1;
+constexpr size_t BLOCKSTORE_HEADER_SIZE = 8;
+constexpr size_t BLOCKSTORE_ENTRY_SIZE = 45;
+
+// A preserved block to be kept in the store.
+struct store_block
+{
+    hasher::B2H contenthash; // Hash of the block data alone.
+    const char *data;        // Stored form of the block.
+    uint32_t storedlength;
+    block_codec codec;
+    off_t offset = 0;        // Set to the store offset the block is kept at.
+    bool duplicate = false;  // Set if an identical block was already in the store.
+};
+
+struct blake2b_hash
+{
+    size_t operator()(const hasher::B2H &h) const { return h.data[0]; }
+};
+
+// Content addressed store of preserved blocks shared by the deltas of all checkpoints. Each distinct block
+// is kept once and delta manifests reference it by its store offset. Reference counts are not persisted.
+// They are rebuilt from the manifests of the retained checkpoints when the store is opened, so a crash
+// cannot leave them out of step. Blocks which lose all their references are released by punching them out.
+class block_store
+{
+private:
+    struct store_entry
+    {
+        hasher::B2H contenthash;
+        uint32_t storedlength;
+        block_codec codec;
+        uint64_t refs;
+    };
+
+    std::string dir;
+    int datafd = -1;
+    int indexfd = -1;
+    off_t datalength = 0;
+    off_t indexlength = 0;
+    std::unordered_map<off_t, store_entry> entries;          // Store offset-->entry.
+    std::unordered_map<hasher::B2H, off_t, blake2b_hash> offsets; // Content hash-->store offset.
+    uint64_t storedbytes = 0;
+    std::mutex mutex;
+
+    int load_refs(const std::vector<std::string> &deltadirs);
+    int load_index(std::vector<char> &buf);
+    int rewrite_index();
+    void release_entry(const off_t offset);
+
+public:
+    ~block_store();
+    int open(const std::string &storedir, const std::vector<std::string> &deltadirs);
+    bool is_open() const { return datafd != -1; }
+    int add_blocks(std::vector<store_block> &blocks);
+    int release(const std::vector<off_t> &refs);
+    size_t size() const { return entries.size(); }
+    uint64_t bytes() const { return storedbytes; }
+};
+
+} // namespace statefs
+
+#endif
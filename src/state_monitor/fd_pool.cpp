@@ -0,0 +1,173 @@
+#include <unistd.h>
+#include "fd_pool.hpp"
+
+namespace statefs
+{
+
+fd_pool::~fd_pool()
+{
+    clear();
+}
+
+/**
+ * Sets the max. no. of fds kept open when they are not in use.
+ */
+void fd_pool::set_capacity(const size_t maxfds)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    capacity = maxfds;
+    trim();
+}
+
+/**
+ * Returns the pooled fd for the given key and pins it. If the pool does not have one, the opener is
+ * invoked to open it. The caller must release the fd once done.
+ * @return The fd. -1 if it could not be opened.
+ */
+int fd_pool::acquire(const uint64_t key, const std::function<int()> &opener)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto itr = entries.find(key);
+        if (itr != entries.end())
+        {
+            lru.splice(lru.begin(), lru, itr->second);
+            itr->second->pins++;
+            return itr->second->fd;
+        }
+    }
+
+    // Open without holding the pool lock. Callers serialize operations on the same key.
+    const int fd = opener();
+    if (fd == -1)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.push_front(entry{key, fd, 1});
+    entries.emplace(key, lru.begin());
+    opencount++;
+    trim();
+    return fd;
+}
+
+/**
+ * Unpins the fd of the given key.
+ * @param evict Whether to close the fd right away instead of keeping it for reuse.
+ */
+void fd_pool::release(const uint64_t key, const bool evict)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto itr = entries.find(key);
+    if (itr == entries.end())
+        return;
+
+    const auto lruitr = itr->second;
+    if (lruitr->pins > 0)
+        lruitr->pins--;
+
+    if (evict && lruitr->pins == 0)
+    {
+        close(lruitr->fd);
+        lru.erase(lruitr);
+        entries.erase(itr);
+    }
+    else
+    {
+        trim();
+    }
+}
+
+/**
+ * Closes the fd of the given key if it is not in use. Used when the file will not be read again.
+ */
+void fd_pool::evict(const uint64_t key)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto itr = entries.find(key);
+    if (itr != entries.end() && itr->second->pins == 0)
+    {
+        close(itr->second->fd);
+        lru.erase(itr->second);
+        entries.erase(itr);
+    }
+}
+
+/**
+ * Closes all the fds which are not in use.
+ */
+void fd_pool::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto itr = lru.begin(); itr != lru.end();)
+    {
+        if (itr->pins > 0)
+        {
+            itr++;
+            continue;
+        }
+
+        close(itr->fd);
+        entries.erase(itr->key);
+        itr = lru.erase(itr);
+    }
+}
+
+size_t fd_pool::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return lru.size();
+}
+
+/**
+ * Returns the no. of fds opened by the pool so far. Opens beyond the no. of distinct files are reopens after eviction.
+ */
+uint64_t fd_pool::opens()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return opencount;
+}
+
+/**
+ * Closes least recently used fds which are not in use until the pool is within capacity. Must be called with the lock held.
+ */
+void fd_pool::trim()
+{
+    for (auto itr = lru.rbegin(); itr != lru.rend() && lru.size() > capacity;)
+    {
+        if (itr->pins > 0)
+        {
+            itr++;
+            continue;
+        }
+
+        close(itr->fd);
+        entries.erase(itr->key);
+        itr = std::make_reverse_iterator(lru.erase(std::next(itr).base()));
+    }
+}
+
+fd_lease::fd_lease(fd_pool &pool, const uint64_t key, const std::function<int()> &opener) : pool(pool), key(key)
+{
+    fd = pool.acquire(key, opener);
+}
+
+fd_lease::~fd_lease()
+{
+    if (fd != -1)
+        pool.release(key, evict);
+}
+
+int fd_lease::get() const
+{
+    return fd;
+}
+
+/**
+ * Closes the fd when the lease ends instead of returning it to the pool.
+ */
+void fd_lease::evict_on_release()
+{
+    evict = true;
+}
+
+} // namespace statefs
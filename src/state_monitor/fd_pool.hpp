@@ -0,0 +1,66 @@
+#ifndef _STATEFS_FD_POOL_
+#define _STATEFS_FD_POOL_
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <functional>
+
+namespace statefs
+{
+
+// Max. capacity of the pool. Well beyond what the fd limit of a process allows.
+constexpr size_t MAX_FDPOOL_SIZE = 1024 * 1024;
+
+// Bounded pool of read fds of tracked files, shared across all files and evicted in least recently used order.
+// Fds in use (pinned) are never evicted. The pool may grow beyond its capacity while more fds than that are
+// pinned and shrinks back as they are released.
+class fd_pool
+{
+private:
+    struct entry
+    {
+        uint64_t key;
+        int fd;
+        uint32_t pins;
+    };
+
+    size_t capacity = 0;
+    std::list<entry> lru; // Most recently used first.
+    std::unordered_map<uint64_t, std::list<entry>::iterator> entries;
+    uint64_t opencount = 0;
+    std::mutex mutex;
+
+    void trim();
+
+public:
+    ~fd_pool();
+    void set_capacity(const size_t maxfds);
+    int acquire(const uint64_t key, const std::function<int()> &opener);
+    void release(const uint64_t key, const bool evict);
+    void evict(const uint64_t key);
+    void clear();
+    size_t size();
+    uint64_t opens();
+};
+
+// Pins a pooled fd for the lifetime of the lease.
+class fd_lease
+{
+private:
+    fd_pool &pool;
+    const uint64_t key;
+    int fd = -1;
+    bool evict = false;
+
+public:
+    fd_lease(fd_pool &pool, const uint64_t key, const std::function<int()> &opener);
+    ~fd_lease();
+    int get() const;
+    void evict_on_release();
+};
+
+} // namespace statefs
+
+#endif
@@ -26,6 +26,9 @@
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 // C++ includes
 #include <cstddef>
@@ -35,58 +38,19 @@
 #include <mutex>
 #include <fstream>
 #include <thread>
+#include <future>
+#include <chrono>
 #include <iomanip>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 #include "state_monitor.hpp"
+#include "fusefs.hpp"
 #include "../state_common.hpp"
+#include "../reflink.hpp"
 
 using namespace std;
 
-// Uniquely identifies a file in the source directory tree. This could
-// be simplified to just ino_t since we require the source directory
-// not to contain any mountpoints. This hasn't been done yet in case
-// we need to reconsider this constraint (but relaxing this would have
-// the drawback that we can no longer re-use inode numbers, and thus
-// readdir() would need to do a full lookup() in order to report the
-// right inode number).
-typedef std::pair<ino_t, dev_t> SrcId;
-
-// Define a hash function for SrcId
-namespace std
-{
-template <>
-struct hash<SrcId>
-{
-    size_t operator()(const SrcId &id) const
-    {
-        return hash<ino_t>{}(id.first) ^ hash<dev_t>{}(id.second);
-    }
-};
-} // namespace std
-
-namespace helpers
-{
-
-int getfilepath(std::string &filepath, int parentfd, const char *filename)
-{
-    // Get parent directory path using the parentfd.
-    char proclnk[32];
-    char parentpath[PATH_MAX];
-    sprintf(proclnk, "/proc/self/fd/%d", parentfd);
-    ssize_t parentlen = readlink(proclnk, parentpath, PATH_MAX);
-    if (parentlen > 0)
-    {
-        // Concat parent dir path and filename to get the full path.
-        filepath.reserve(parentlen + strlen(filename) + 1);
-        filepath.append(parentpath, parentlen).append("/").append(filename);
-        return 0;
-    }
-    return -1;
-}
-
-} // namespace helpers
-
 namespace fusefs
 {
 
@@ -116,6 +80,9 @@ struct Inode
     uint64_t nlookup{0};
     std::mutex m;
 
+    // State monitor tracking record of this file. Attached on open/create.
+    statefs::fileinfo_slot fileinfo;
+
     // Delete copy constructor and assignments. We could implement
     // move if we need it.
     Inode() = default;
@@ -194,6 +161,7 @@ static void sfs_init(void *userdata, fuse_conn_info *conn)
 
 static void sfs_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 {
+    statefs::op_scope scope(statemonitor.gate);
     (void)fi;
     Inode &inode = get_inode(ino);
     struct stat attr;
@@ -319,9 +287,12 @@ out_err:
 static void sfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
                         int valid, fuse_file_info *fi)
 {
-    // We use some conditions to detect truncate call.
-    if (fi != NULL && fi->fh > 0 && attr->st_size > 0)
-        statemonitor.ontruncate(fi->fh, attr->st_size);
+    statefs::op_scope scope(statemonitor.gate);
+    if (valid & FUSE_SET_ATTR_SIZE)
+    {
+        Inode &inode = get_inode(ino);
+        statemonitor.ontruncate(inode.fileinfo, inode.fd, attr->st_size);
+    }
 
     (void)ino;
     do_setattr(req, ino, attr, valid, fi);
@@ -411,6 +382,7 @@ static int do_lookup(fuse_ino_t parent, const char *name,
 
 static void sfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    statefs::op_scope scope(statemonitor.gate);
     fuse_entry_param e{};
     auto err = do_lookup(parent, name, &e);
     if (err == ENOENT)
@@ -436,6 +408,7 @@ static void mknod_symlink(fuse_req_t req, fuse_ino_t parent,
                           const char *name, mode_t mode, dev_t rdev,
                           const char *link)
 {
+    statefs::op_scope scope(statemonitor.gate);
     int res;
     Inode &inode_p = get_inode(parent);
     auto saverr = ENOMEM;
@@ -503,6 +476,7 @@ static int linkat_empty_nofollow(Inode &inode, int dfd, const char *name)
 static void sfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
                      const char *name)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode = get_inode(ino);
     Inode &inode_p = get_inode(parent);
     fuse_entry_param e{};
@@ -535,6 +509,7 @@ static void sfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t parent,
 
 static void sfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode_p = get_inode(parent);
     lock_guard<mutex> g{inode_p.m};
     auto res = unlinkat(inode_p.fd, name, AT_REMOVEDIR);
@@ -545,6 +520,7 @@ static void sfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
                        fuse_ino_t newparent, const char *newname,
                        unsigned int flags)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode_p = get_inode(parent);
     Inode &inode_np = get_inode(newparent);
     if (flags)
@@ -553,11 +529,10 @@ static void sfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
         return;
     }
 
-    std::string oldfilepath, newfilepath;
-    if (helpers::getfilepath(oldfilepath, inode_p.fd, name) == 0 &&
-        helpers::getfilepath(newfilepath, inode_np.fd, newname) == 0)
+    if (statemonitor.onrename(inode_p.fd, name, inode_np.fd, newname) != 0)
     {
-        statemonitor.onrename(oldfilepath, newfilepath);
+        fuse_reply_err(req, EIO);
+        return;
     }
 
     auto res = renameat(inode_p.fd, name, inode_np.fd, newname);
@@ -566,11 +541,14 @@ static void sfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode_p = get_inode(parent);
 
-    std::string filepath;
-    if (helpers::getfilepath(filepath, inode_p.fd, name) == 0)
-        statemonitor.ondelete(filepath);
+    if (statemonitor.ondelete(inode_p.fd, name) != 0)
+    {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
     auto res = unlinkat(inode_p.fd, name, 0);
     fuse_reply_err(req, res == -1 ? errno : 0);
@@ -619,6 +597,7 @@ static void sfs_forget_multi(fuse_req_t req, size_t count,
 
 static void sfs_readlink(fuse_req_t req, fuse_ino_t ino)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode = get_inode(ino);
     char buf[PATH_MAX + 1];
     auto res = readlinkat(inode.fd, "", buf, sizeof(buf));
@@ -707,6 +686,7 @@ static bool is_dot_or_dotdot(const char *name)
 static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                        off_t offset, fuse_file_info *fi, int plus)
 {
+    statefs::op_scope scope(statemonitor.gate);
     auto d = get_dir_handle(fi);
     Inode &inode = get_inode(ino);
     lock_guard<mutex> g{inode.m};
@@ -843,6 +823,7 @@ static void sfs_releasedir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
                        mode_t mode, fuse_file_info *fi)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode_p = get_inode(parent);
 
     auto fd = openat(inode_p.fd, name,
@@ -865,9 +846,16 @@ static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
             cerr << "ERROR: Reached maximum number of file descriptors." << endl;
         fuse_reply_err(req, err);
     }
+    else if (statemonitor.oncreate(get_inode(e.ino).fileinfo, fd) != 0)
+    {
+        // Restore could not delete the file if it is left without a new files record.
+        forget_one(e.ino, 1);
+        close(fd);
+        unlinkat(inode_p.fd, name, 0);
+        fuse_reply_err(req, EIO);
+    }
     else
     {
-        statemonitor.oncreate(fd);
         fuse_reply_create(req, &e, fi);
     }
 }
@@ -887,6 +875,7 @@ static void sfs_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
 
 static void sfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 {
+    statefs::op_scope scope(statemonitor.gate);
     Inode &inode = get_inode(ino);
 
     /* With writeback cache, kernel may send read requests even
@@ -911,7 +900,7 @@ static void sfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
     char buf[64];
     sprintf(buf, "/proc/self/fd/%i", inode.fd);
 
-    statemonitor.onopen(inode.fd, fi->flags);
+    statemonitor.onopen(inode.fileinfo, inode.fd, fi->flags);
 
     auto fd = open(buf, fi->flags & ~O_NOFOLLOW);
     if (fd == -1)
@@ -931,9 +920,7 @@ static void sfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 
 static void sfs_release(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 {
-    (void)ino;
     close(fi->fh);
-    statemonitor.onclose(fi->fh);
     fuse_reply_err(req, 0);
 }
 
@@ -971,6 +958,7 @@ static void do_read(fuse_req_t req, size_t size, off_t off, fuse_file_info *fi)
 static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                      fuse_file_info *fi)
 {
+    statefs::op_scope scope(statemonitor.gate);
     (void)ino;
     do_read(req, size, off, fi);
 }
@@ -994,10 +982,12 @@ static void do_write_buf(fuse_req_t req, size_t size, off_t off,
 static void sfs_write_buf(fuse_req_t req, fuse_ino_t ino, fuse_bufvec *in_buf,
                           off_t off, fuse_file_info *fi)
 {
-    (void)ino;
+    // Writeback of cached pages is let through while the gate flushes the mount for a checkpoint.
+    statefs::op_scope scope(statemonitor.gate, fi->writepage);
+    Inode &inode = get_inode(ino);
     auto size{fuse_buf_size(in_buf)};
 
-    statemonitor.onwrite(fi->fh, off, size);
+    statemonitor.onwrite(inode.fileinfo, inode.fd, off, size);
 
     do_write_buf(req, size, off, in_buf, fi);
 }
@@ -1017,14 +1007,12 @@ static void sfs_statfs(fuse_req_t req, fuse_ino_t ino)
 static void sfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
                           off_t offset, off_t length, fuse_file_info *fi)
 {
-    (void)ino;
-    if (mode)
-    {
-        fuse_reply_err(req, EOPNOTSUPP);
-        return;
-    }
+    // Modes which change the data (punch hole, zero/collapse/insert range) need the affected blocks preserved first.
+    statefs::op_scope scope(statemonitor.gate);
+    Inode &inode = get_inode(ino);
+    statemonitor.onfallocate(inode.fileinfo, inode.fd, mode, offset, length);
 
-    auto err = posix_fallocate(fi->fh, offset, length);
+    auto err = mode == 0 ? posix_fallocate(fi->fh, offset, length) : (fallocate(fi->fh, mode, offset, length) == -1 ? errno : 0);
     fuse_reply_err(req, err);
 }
 #endif
@@ -1251,7 +1239,353 @@ void maximize_fd_limit()
         warn("WARNING: setrlimit() failed with");
 }
 
-int start(const char *arg0, const char *statehistdir, const char *fusemntdir)
+/**
+ * Detaches the tracking records from all the inodes so they get attached afresh against a new checkpoint.
+ * Only called while file system operations are held off by the state monitor gate.
+ */
+static void detach_fileinfo_slots()
+{
+    auto detach = [](Inode &inode) {
+        std::atomic_store(&inode.fileinfo.fileinfo, std::shared_ptr<statefs::state_file_info>());
+        inode.fileinfo.preservelimit.store(-1, std::memory_order_release);
+    };
+
+    std::lock_guard<std::mutex> lock(fs.mutex);
+    detach(fs.root);
+    for (auto &[id, inode] : fs.inodes)
+        detach(inode);
+}
+
+/**
+ * Returns the fuse inode no. of the given file in the source tree, or 0 if the kernel does not know the file.
+ */
+static fuse_ino_t find_ino(const std::string &relpath)
+{
+    if (relpath.empty() || relpath == "/")
+        return FUSE_ROOT_ID;
+
+    struct stat st;
+    if (fstatat(fs.root.fd, relpath.c_str() + 1, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(fs.mutex);
+    const auto itr = fs.inodes.find(SrcId{st.st_ino, st.st_dev});
+    if (itr == fs.inodes.end() || itr->second.fd == -1)
+        return 0;
+    return reinterpret_cast<fuse_ino_t>(&itr->second);
+}
+
+/**
+ * Drops what the kernel has cached for the given files after their contents or entries were changed
+ * underneath the mount. Files and dirs the kernel does not know about have nothing cached.
+ * @param relpaths Paths of the files relative to the source dir.
+ */
+static void invalidate_paths(fuse_session *se, const std::vector<std::string> &relpaths)
+{
+    std::unordered_set<std::string> done;
+    for (const std::string &relpath : relpaths)
+    {
+        if (!done.emplace(relpath).second)
+            continue;
+
+        const size_t slashpos = relpath.find_last_of('/');
+        const std::string name = relpath.substr(slashpos + 1);
+        const fuse_ino_t parentino = find_ino(relpath.substr(0, slashpos));
+        if (parentino != 0)
+            fuse_lowlevel_notify_inval_entry(se, parentino, name.c_str(), name.size());
+
+        const fuse_ino_t ino = find_ino(relpath);
+        if (ino != 0)
+            fuse_lowlevel_notify_inval_inode(se, ino, 0, 0);
+    }
+}
+
+/**
+ * Writes back the pages the kernel has dirtied on the mount and waits for it.
+ */
+static void sync_mount(const std::string &fusemntdir)
+{
+    const int mntfd = open(fusemntdir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (mntfd != -1)
+    {
+        syncfs(mntfd);
+        close(mntfd);
+    }
+}
+
+/**
+ * Starts a kernel call on a thread of its own. Calls like syncfs and cache invalidation may wait on an operation
+ * held off by the gate (eg. a held off truncate keeps the writeback of its file from completing and a held off
+ * lookup keeps its parent dir locked), so they are waited for with a timeout while the gate is closed.
+ * @return Future which is ready once the call has completed.
+ */
+static std::future<void> start_kernelcall(std::function<void()> call)
+{
+    auto task = std::make_shared<std::packaged_task<void()>>(std::move(call));
+    std::future<void> done = task->get_future();
+    std::thread([task]() { (*task)(); }).detach();
+    return done;
+}
+
+/**
+ * Waits for a kernel call started with the gate closed for up to KERNEL_WAIT_MS.
+ * @return Whether the call completed in time.
+ */
+static bool wait_kernelcall(std::future<void> &done, const char *callname)
+{
+    if (done.wait_for(std::chrono::milliseconds(statefs::KERNEL_WAIT_MS)) == std::future_status::ready)
+        return true;
+
+    std::cerr << callname << " is waiting on held off operations.\n";
+    return false;
+}
+
+/**
+ * Holds off file system operations for a checkpoint or a rollback and writes back everything the kernel has
+ * cached for the session before it. Most of the dirty pages are written back while operations still flow.
+ * Operations which were in flight when the gate closed may have dirtied more, so the mount is synced again
+ * with the gate closed.
+ * @return 0 if the operations are held off with the mount synced. -1 if the sync did not complete in time,
+ *         in which case the operations are let through again.
+ */
+static int hold_operations(const std::string &fusemntdir)
+{
+    sync_mount(fusemntdir);
+    statemonitor.gate.close();
+
+    bool synced = false;
+    statemonitor.gate.flush([&]() {
+        std::future<void> done = start_kernelcall([fusemntdir]() { sync_mount(fusemntdir); });
+        synced = wait_kernelcall(done, "Sync");
+    });
+
+    if (!synced)
+    {
+        statemonitor.gate.open();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Drops the kernel caches of the given files and then lets the held off operations continue, so no operation
+ * sees the cached state from before a rollback. If invalidation waits on a held off operation the operations
+ * are let through before it completes.
+ * @return 0 if the caches were dropped before the operations continued. -1 if operations may have seen
+ *         cached state from before the rollback.
+ */
+static int invalidate_and_open(fuse_session *se, const std::vector<std::string> &relpaths)
+{
+    std::future<void> done = start_kernelcall([&]() { invalidate_paths(se, relpaths); });
+    const bool invalidated = wait_kernelcall(done, "Cache invalidation");
+    statemonitor.gate.open();
+    done.wait();
+    return invalidated ? 0 : -1;
+}
+
+/**
+ * Serves the commands sent to the control socket until the socket is shut down. A checkpoint command
+ * cuts a checkpoint of the mounted state and replies with its generation. A rollback command rolls the
+ * mounted state back to the latest checkpoint.
+ * @param listenfd Listening control socket.
+ * @param se Fuse session of the mount, whose kernel caches are invalidated after a rollback.
+ * @param fusemntdir Fuse mount dir, synced before a checkpoint is cut or rolled back.
+ */
+static void serve_control(const int listenfd, fuse_session *se, const std::string fusemntdir)
+{
+    while (true)
+    {
+        const int connfd = accept(listenfd, NULL, NULL);
+        if (connfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            return;
+        }
+
+        // A client which connects and never sends its command must not hold up the control socket.
+        const timeval timeout{statefs::CONTROL_RECV_TIMEOUT, 0};
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char buf[64];
+        const ssize_t len = read(connfd, buf, sizeof(buf) - 1);
+        std::string command(buf, len > 0 ? len : 0);
+        command.erase(command.find_last_not_of("\r\n") + 1);
+
+        std::string reply = "error\n";
+        if (command == "checkpoint")
+        {
+            // Dirty pages cached by the kernel belong to the session before the checkpoint. If they could not
+            // be written back the checkpoint is not cut and the client can retry.
+            uint64_t generation = 0;
+            if (hold_operations(fusemntdir) == -1)
+            {
+                std::cerr << "Mount not synced. Checkpoint not cut.\n";
+            }
+            else
+            {
+                if (statemonitor.cut_checkpoint(generation, detach_fileinfo_slots) == 0)
+                {
+                    reply = "ok " + std::to_string(generation) + "\n";
+                    std::cout << "Checkpoint " << generation << " cut.\n";
+                }
+                statemonitor.gate.open();
+            }
+        }
+        else if (command == "rollback")
+        {
+            // Dirty pages cached by the kernel must not be written back over the rolled back state.
+            std::vector<std::string> touchedpaths;
+            if (hold_operations(fusemntdir) == -1)
+            {
+                std::cerr << "Mount not synced. Rollback not done.\n";
+            }
+            else
+            {
+                const int ret = statemonitor.rollback_checkpoint(touchedpaths, detach_fileinfo_slots);
+                const int invalidated = invalidate_and_open(se, touchedpaths);
+                if (ret == 0 && invalidated == -1)
+                    std::cerr << "Rolled back without dropping all the kernel caches.\n";
+                else if (ret == 0)
+                {
+                    reply = "ok\n";
+                    std::cout << "Rolled back " << touchedpaths.size() << " paths.\n";
+                }
+            }
+        }
+
+        if (write(connfd, reply.data(), reply.size()) == -1)
+            std::cerr << errno << ": Control socket reply failed\n";
+        close(connfd);
+    }
+}
+
+/**
+ * Creates the listening control socket of the monitor in the given state history dir.
+ * @return The socket fd. -1 on failure.
+ */
+static int open_control_socket(const std::string &sockpath)
+{
+    sockaddr_un addr{};
+    if (sockpath.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Control socket path too long " << sockpath << "\n";
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath.c_str());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        std::cerr << errno << ": Control socket creation failed\n";
+        return -1;
+    }
+
+    // A socket left behind by an earlier run which did not exit cleanly.
+    unlink(sockpath.c_str());
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == -1 || chmod(sockpath.c_str(), 0600) == -1 || listen(fd, 4) == -1)
+    {
+        std::cerr << errno << ": Control socket bind failed " << sockpath << "\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends a command to the monitor running on the given state history dir and prints the result it replies with.
+ * @param command checkpoint or rollback.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int send_command(const char *statehistdir, const std::string &command)
+{
+    const std::string sockpath = std::string(statehistdir) + statefs::CONTROL_SOCKET_FNAME;
+    sockaddr_un addr{};
+    if (sockpath.size() >= sizeof(addr.sun_path))
+    {
+        std::cerr << "Control socket path too long " << sockpath << "\n";
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath.c_str());
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        std::cerr << errno << ": Connect failed " << sockpath << "\n";
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    const std::string request = command + "\n";
+    char buf[64];
+    ssize_t len = -1;
+    if (write(fd, request.data(), request.size()) == (ssize_t)request.size())
+        len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    const std::string reply(buf, len > 0 ? len : 0);
+    if (reply.compare(0, 2, "ok") != 0)
+    {
+        std::cerr << "Command " << command << " failed.\n";
+        return -1;
+    }
+
+    if (reply.size() > 3)
+        std::cout << reply.substr(3);
+    return 0;
+}
+
+/**
+ * Applies a statemon command line option of the form --name=value to the monitor config.
+ * @return 0 if the option was recognized. -1 otherwise.
+ */
+int parse_option(statefs::monitor_config &config, const std::string &option)
+{
+    const size_t eqpos = option.find('=');
+    if (option.compare(0, 2, "--") != 0 || eqpos == std::string::npos)
+        return -1;
+
+    const std::string name = option.substr(2, eqpos - 2);
+    const std::string value = option.substr(eqpos + 1);
+    statefs::block_codec codec;
+    uint64_t number = 0;
+
+    if (name == "copy" && value == "kernel")
+        config.copymode = statefs::copy_mode::KERNEL;
+    else if (name == "copy" && value == "buffered")
+        config.copymode = statefs::copy_mode::BUFFERED;
+    else if (name == "copy" && value == "uring")
+        config.copymode = statefs::copy_mode::URING;
+    else if (name == "reflink" && (value == "on" || value == "off"))
+        config.reflink = value == "on";
+    else if (name == "linkdeleted" && (value == "on" || value == "off"))
+        config.linkdeleted = value == "on";
+    else if (name == "fdpool" && statefs::parse_number(number, value, 1, statefs::MAX_FDPOOL_SIZE) == 0)
+        config.fdpoolsize = number;
+    else if (name == "trackmem" && statefs::parse_number(number, value, 0, SIZE_MAX / (1024 * 1024)) == 0)
+        config.trackmemory = number * 1024 * 1024;
+    else if (name == "compress" && statefs::parse_codec(codec, value))
+        config.compression = codec;
+    else if (name == "retention" && statefs::parse_number(number, value, 1, UINT32_MAX) == 0)
+        config.retention = number;
+    else if (name == "dedup" && (value == "on" || value == "off"))
+        config.dedup = value == "on";
+    else if (name == "resume" && (value == "on" || value == "off"))
+        config.resume = value == "on";
+    else if (name == "blocksize" && value == "auto")
+        config.blocksize = 0;
+    else if (name == "blocksize" && statefs::parse_number(number, value, 1, UINT32_MAX) == 0 && statefs::is_valid_blocksize(number))
+        config.blocksize = number;
+    else
+        return -1;
+
+    return 0;
+}
+
+int start(const char *arg0, const char *statehistdir, const char *fusemntdir, const statefs::monitor_config &config)
 {
     // We need an fd for every entry in our the filesystem that the
     // kernel knows about. This is way more than most processes need,
@@ -1262,13 +1596,21 @@ int start(const char *arg0, const char *statehistdir, const char *fusemntdir)
     const bool firstrun = boost::filesystem::is_empty(statehistdir);
 
     statefs::statedir_context dirctx = statefs::init(statehistdir);
+    if (dirctx.deltadir.empty())
+        errx(1, "ERROR: cannot read the checkpoints of \"%s\"", statehistdir);
     fs.source = dirctx.datadir;
     statemonitor.ctx = dirctx;
+    statemonitor.config = config;
 
-    // Create a checkpoint from the second run onwards.
-    if (!firstrun)
+    // Create a checkpoint from the second run onwards unless we are continuing the previous session.
+    if (!firstrun && !config.resume)
         statemonitor.create_checkpoint();
 
+    // Probe whether copy-on-write can share extents between the state data and the delta segment. The probe
+    // clones into the delta dir of the session since the deltas may be on a different file system than the state.
+    const bool reflink_capable = statefs::probe_reflink(dirctx.rootdir, statemonitor.ctx.deltadir);
+    statemonitor.init(reflink_capable);
+
     // Initialize filesystem root
     fs.root.fd = -1;
     fs.root.nlookup = 9999;
@@ -1314,9 +1656,32 @@ int start(const char *arg0, const char *statehistdir, const char *fusemntdir)
     if (fuse_session_mount(se, fusemntdir) != 0)
         goto err_out3;
 
-    ret = fuse_session_loop_mt(se, &loop_config);
+    {
+        // Control socket through which checkpoints can be cut while mounted.
+        const std::string sockpath = std::string(statehistdir) + statefs::CONTROL_SOCKET_FNAME;
+        const int controlfd = open_control_socket(sockpath);
+        std::thread controlthread;
+        if (controlfd != -1)
+            controlthread = std::thread(serve_control, controlfd, se, std::string(fusemntdir));
+
+        ret = fuse_session_loop_mt(se, &loop_config);
+
+        if (controlfd != -1)
+        {
+            shutdown(controlfd, SHUT_RDWR);
+            controlthread.join();
+            close(controlfd);
+            unlink(sockpath.c_str());
+        }
+    }
 
     fuse_session_unmount(se);
+    if (statemonitor.close_delta() == -1)
+    {
+        cerr << "ERROR: Completing the session delta failed." << endl;
+        ret = -1;
+    }
+    statemonitor.print_stats(std::cout);
 
 err_out3:
     fuse_remove_signal_handlers(se);
@@ -1332,11 +1697,28 @@ err_out1:
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3)
+    // Usage: statemon <state hist dir> <fuse mount dir> [--copy=buffered|kernel|uring] [--reflink=on|off] [--linkdeleted=on|off] [--fdpool=<max fds>]
+    //                 [--blocksize=auto|4096|65536|1048576] [--resume=on|off] [--trackmem=<MB>]
+    //                 [--compress=off|lz4|zstd] [--dedup=on|off] [--retention=<checkpoints>]
+    //        statemon checkpoint|rollback <state hist dir>
+    statefs::monitor_config config;
+    if (argc == 3 && (strcmp(argv[1], "checkpoint") == 0 || strcmp(argv[1], "rollback") == 0))
+        return fusefs::send_command(argv[2], argv[1]) == 0 ? 0 : 1;
+
+    if (argc < 3)
     {
         std::cerr << "Incorrect arguments.\n";
         exit(1);
     }
 
-    fusefs::start(argv[0], argv[1], argv[2]);
+    for (int i = 3; i < argc; i++)
+    {
+        if (fusefs::parse_option(config, argv[i]) == -1)
+        {
+            std::cerr << "Incorrect argument " << argv[i] << "\n";
+            exit(1);
+        }
+    }
+
+    fusefs::start(argv[0], argv[1], argv[2], config);
 }
\ No newline at end of file
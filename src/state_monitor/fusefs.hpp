@@ -1,9 +1,14 @@
 #ifndef _FUSE_FS_
 #define _FUSE_FS_
 
+#include <string>
+#include "state_monitor.hpp"
+
 namespace fusefs
 {
-int start(const char *arg0, const char *source, const char *mountpoint, const char *deltadir);
+int parse_option(statefs::monitor_config &config, const std::string &option);
+int send_command(const char *statehistdir, const std::string &command);
+int start(const char *arg0, const char *statehistdir, const char *fusemntdir, const statefs::monitor_config &config);
 }
 
 #endif
\ No newline at end of file
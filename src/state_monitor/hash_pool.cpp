@@ -0,0 +1,193 @@
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <errno.h>
+#include <chrono>
+#include "../hasher.hpp"
+#include "../state_common.hpp"
+#include "hash_pool.hpp"
+
+namespace statefs
+{
+
+hash_pool::hash_pool(const size_t workercount, hash_sink sink) : workercount(workercount), sink(std::move(sink))
+{
+}
+
+hash_pool::~hash_pool()
+{
+    stop();
+}
+
+/**
+ * Queues a batch of blocks for hashing. Worker threads are started with the first job.
+ */
+void hash_pool::enqueue(hash_job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (workers.empty())
+        {
+            stopping = false;
+            for (size_t i = 0; i < workercount; i++)
+                workers.emplace_back(&hash_pool::run, this);
+        }
+
+        jobs.push_back(std::move(job));
+        pendingjobs++;
+    }
+    jobcv.notify_one();
+}
+
+/**
+ * Barrier which blocks until all the queued hash jobs are completed.
+ * @return 0 if all the jobs since the last reset succeeded. -1 if any of them failed.
+ */
+int hash_pool::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    idlecv.wait(lock, [&] { return pendingjobs == 0; });
+    return failed ? -1 : 0;
+}
+
+/**
+ * Clears the failure of earlier jobs. Called when their delta is no longer written to.
+ */
+void hash_pool::reset()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = false;
+}
+
+/**
+ * Completes all the queued jobs and stops the worker threads.
+ */
+void hash_pool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    jobcv.notify_all();
+
+    for (std::thread &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+void hash_pool::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+        jobcv.wait(lock, [&] { return stopping || !jobs.empty(); });
+        if (jobs.empty())
+            return; // Stopping and no more jobs to process.
+
+        hash_job job = std::move(jobs.front());
+        jobs.pop_front();
+
+        lock.unlock();
+        const int ret = process_job(job);
+        lock.lock();
+
+        if (ret == -1)
+            failed = true;
+
+        if (--pendingjobs == 0)
+            idlecv.notify_all();
+    }
+}
+
+/**
+ * Reads back the batch of blocks from the segment and passes their hashes and stored form to the sink.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int hash_pool::process_job(const hash_job &job)
+{
+    thread_local std::vector<char> blocks;
+    std::vector<hasher::B2H> hashes(job.blocks.size());
+    packed_blocks packed;
+    packed.lengths.resize(job.blocks.size(), job.blocksize);
+    if (job.dedup)
+        packed.contenthashes.resize(job.blocks.size());
+
+    // Blocks contiguous in the segment are read together.
+    for (size_t first = 0; first < job.blocks.size();)
+    {
+        // Zero blocks are not in the segment. Block hash is computed over the original block offset and the block data.
+        if (job.blocks[first].second == ZERO_BLOCK_OFFSET)
+        {
+            const off_t blockoffset = (off_t)job.blocksize * job.blocks[first].first;
+            hashes[first] = hasher::hash(&blockoffset, 8, ZERO_BLOCK, job.blocksize);
+            packed.lengths[first++] = 0;
+            continue;
+        }
+
+        size_t last = first;
+        while (last + 1 < job.blocks.size() && job.blocks[last + 1].second == job.blocks[last].second + (off_t)job.blocksize)
+            last++;
+
+        const size_t runlength = (last - first + 1) * job.blocksize;
+        if (blocks.size() < runlength)
+            blocks.resize(runlength);
+
+        if (pread(job.cachefd, blocks.data(), runlength, job.blocks[first].second) != (ssize_t)runlength)
+        {
+            std::cerr << errno << ": Read from delta segment failed\n";
+            return -1;
+        }
+
+        for (size_t idx = first; idx <= last; idx++)
+        {
+            const off_t blockoffset = (off_t)job.blocksize * job.blocks[idx].first;
+            hashes[idx] = hasher::hash(&blockoffset, 8, blocks.data() + (idx - first) * job.blocksize, job.blocksize);
+        }
+
+        pack_run(job, packed, blocks.data(), first, last);
+        first = last + 1;
+    }
+
+    return sink(job, hashes, packed);
+}
+
+/**
+ * Works out how each block of a run is stored. All zero blocks store nothing. Others get compressed
+ * copies if the job asks for compression and they shrink. Blocks bound for the block store are hashed
+ * by content and the ones staying raw are copied as well.
+ * @param run Blocks first..last of the job back to back.
+ */
+void hash_pool::pack_run(const hash_job &job, packed_blocks &packed, const char *run, const size_t first, const size_t last)
+{
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t idx = first; idx <= last; idx++)
+    {
+        const char *block = run + (idx - first) * job.blocksize;
+        if (is_zero_block(block, job.blocksize))
+        {
+            packed.lengths[idx] = 0;
+        }
+        else if (job.codec != block_codec::NONE)
+        {
+            const size_t pos = packed.data.size();
+            packed.data.resize(pos + job.blocksize);
+            const size_t length = compress_block(job.codec, block, job.blocksize, packed.data.data() + pos);
+            packed.data.resize(pos + length);
+            if (length > 0)
+                packed.lengths[idx] = length;
+        }
+
+        if (job.dedup && packed.lengths[idx] == job.blocksize)
+            packed.data.insert(packed.data.end(), block, block + job.blocksize);
+    }
+    if (job.codec != block_codec::NONE)
+        packed.nanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+    for (size_t idx = first; job.dedup && idx <= last; idx++)
+    {
+        if (packed.lengths[idx] > 0)
+            packed.contenthashes[idx] = hasher::hash(run + (idx - first) * job.blocksize, job.blocksize, NULL, 0);
+    }
+}
+
+} // namespace statefs
@@ -0,0 +1,81 @@
+#ifndef _STATEFS_HASH_POOL_
+#define _STATEFS_HASH_POOL_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include "../hasher.hpp"
+#include "../block_codec.hpp"
+
+namespace statefs
+{
+
+// A batch of preserved blocks whose hashes need to be filled into the delta manifest. The block records
+// of the batch are laid out back to back in the manifest.
+struct hash_job
+{
+    int cachefd;                                    // fd of the segment file holding the blocks.
+    off_t recordoffset;                             // Manifest offset of the first block record.
+    uint32_t blocksize;                             // Block size of the file the blocks belong to.
+    block_codec codec;                              // Codec to compress the blocks with. NONE to leave them raw.
+    bool dedup;                                     // Whether the blocks go to the block store.
+    std::vector<std::pair<uint32_t, off_t>> blocks; // Original block id and segment offset of each block.
+};
+
+// Segment offset of blocks which are all zeros (eg. holes of sparse files). Nothing is stored for them.
+constexpr off_t ZERO_BLOCK_OFFSET = -1;
+
+// How the blocks of a job end up stored in the segment.
+struct packed_blocks
+{
+    std::vector<char> data;        // Compressed copies back to back in the order of the blocks. With dedup
+                                   // the raw blocks are included as well.
+    std::vector<uint32_t> lengths; // Stored length of each block. The block size if it stays raw, 0 if it is all zeros.
+    std::vector<hasher::B2H> contenthashes; // Hash of the data of each block. Only computed with dedup.
+    uint64_t nanos = 0;            // Time spent compressing.
+};
+
+// Receives the computed hashes and the stored form of a job in the order of its blocks.
+typedef std::function<int(const hash_job &job, const std::vector<hasher::B2H> &hashes, const packed_blocks &packed)> hash_sink;
+
+// Pool of background workers which compute the hashes of preserved blocks by reading them back from
+// the segment and pass them on to be written into the manifest. This keeps hashing out of the write path.
+// Blocks are checked for zeros, compressed and hashed by content for the block store here as well while
+// they are at hand.
+class hash_pool
+{
+private:
+    const size_t workercount;
+    const hash_sink sink;
+    std::vector<std::thread> workers;
+    std::deque<hash_job> jobs;
+    size_t pendingjobs = 0;
+    bool stopping = false;
+    bool failed = false; // Whether a job failed since the last reset. Its records are left without hashes.
+
+    std::mutex mutex;
+    std::condition_variable jobcv;  // Notified when a job is queued or the pool is stopping.
+    std::condition_variable idlecv; // Notified when all queued jobs are completed.
+
+    void run();
+    int process_job(const hash_job &job);
+    void pack_run(const hash_job &job, packed_blocks &packed, const char *run, const size_t first, const size_t last);
+
+public:
+    hash_pool(const size_t workercount, hash_sink sink);
+    ~hash_pool();
+    void enqueue(hash_job job);
+    int wait();
+    void reset();
+    void stop();
+};
+
+} // namespace statefs
+
+#endif
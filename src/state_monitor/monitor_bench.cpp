@@ -0,0 +1,254 @@
+/**
+ * Throughput benchmark of the state monitor. Several threads write to distinct original files at once, calling
+ * the monitor hooks the same way the multi-threaded FUSE loop does, so every write preserves one original block.
+ * The run is repeated for 1, 2, 4... threads in a fresh state history dir under the given scratch dir.
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include "../state_common.hpp"
+#include "state_monitor.hpp"
+
+namespace statefs
+{
+
+// Upper limits of the writer threads and files of a run. Every file keeps an fd open for the whole run.
+constexpr uint64_t MAX_BENCH_THREADS = 1024;
+constexpr uint64_t MAX_BENCH_FILES = 64 * 1024;
+
+struct bench_config
+{
+    size_t maxthreads = 8;
+    size_t filecount = 32;
+    size_t filesize = 8 * 1024 * 1024;
+    size_t stride = 64 * 1024; // Distance between two writes in a file. Each write preserves the block it lands on.
+
+    // Whether to evict the original files from the page cache so preservation reads hit the disk.
+    bool cold = false;
+
+    // Whether to run all monitor hooks under one global mutex, the way the monitor did before its locks were striped.
+    bool serial = false;
+
+    monitor_config monitor;
+};
+
+struct bench_file
+{
+    std::string filepath;
+    int inodefd = -1;
+    fileinfo_slot slot;
+};
+
+struct bench_result
+{
+    double seconds = 0;
+    std::vector<double> latencies; // Microseconds spent in each onwrite() call.
+};
+
+/**
+ * Creates the original files of a run and fills them with non-zero data.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int create_files(std::vector<std::unique_ptr<bench_file>> &files, const std::string &datadir, const bench_config &config)
+{
+    std::vector<char> buf(config.stride);
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (char)(i * 31 + 7);
+
+    for (size_t i = 0; i < config.filecount; i++)
+    {
+        auto file = std::make_unique<bench_file>();
+        file->filepath = datadir + "/f" + std::to_string(i);
+
+        const int fd = open(file->filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, FILE_PERMS);
+        if (fd == -1)
+        {
+            std::cerr << errno << ": Open failed " << file->filepath << "\n";
+            return -1;
+        }
+
+        for (off_t offset = 0; offset < (off_t)config.filesize; offset += buf.size())
+        {
+            if (pwrite(fd, buf.data(), buf.size(), offset) == -1)
+            {
+                std::cerr << errno << ": Write failed " << file->filepath << "\n";
+                close(fd);
+                return -1;
+            }
+        }
+
+        // Written back pages can be dropped from the page cache.
+        fsync(fd);
+        if (config.cold)
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+
+        file->inodefd = open(file->filepath.c_str(), O_PATH);
+        files.push_back(std::move(file));
+    }
+
+    return 0;
+}
+
+/**
+ * Writes to the files handled by one thread, notifying the monitor before each write.
+ */
+void write_files(state_monitor &monitor, std::mutex &serial_mutex, std::vector<std::unique_ptr<bench_file>> &files,
+                 const size_t threadidx, const size_t threadcount, const bench_config &config, std::vector<double> &latencies)
+{
+    const std::vector<char> buf(BLOCK_SIZE, 'x');
+
+    for (size_t i = threadidx; i < files.size(); i += threadcount)
+    {
+        bench_file &file = *files[i];
+        {
+            std::unique_lock<std::mutex> lock(serial_mutex, std::defer_lock);
+            if (config.serial)
+                lock.lock();
+            monitor.onopen(file.slot, file.inodefd, O_RDWR);
+        }
+
+        const int fd = open(file.filepath.c_str(), O_RDWR);
+        for (off_t offset = 0; offset < (off_t)config.filesize; offset += config.stride)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            {
+                std::unique_lock<std::mutex> lock(serial_mutex, std::defer_lock);
+                if (config.serial)
+                    lock.lock();
+                monitor.onwrite(file.slot, file.inodefd, offset, buf.size());
+            }
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+
+            if (pwrite(fd, buf.data(), buf.size(), offset) == -1)
+                std::cerr << errno << ": Write failed " << file.filepath << "\n";
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Runs one session with the given no. of writer threads in a fresh state history dir.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int run_session(bench_result &result, const std::string &rootdir, const size_t threadcount, const bench_config &config)
+{
+    boost::filesystem::remove_all(rootdir);
+    boost::filesystem::create_directories(rootdir);
+
+    state_monitor monitor;
+    monitor.ctx = init(rootdir);
+    monitor.config = config.monitor;
+
+    std::vector<std::unique_ptr<bench_file>> files;
+    if (monitor.ctx.deltadir.empty() || create_files(files, monitor.ctx.datadir, config) == -1)
+        return -1;
+
+    // Blocks are copied rather than shared so the copy path is measured.
+    monitor.init(false);
+
+    std::mutex serial_mutex;
+    std::vector<std::vector<double>> latencies(threadcount);
+    std::vector<std::thread> threads;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threadcount; i++)
+        threads.emplace_back(write_files, std::ref(monitor), std::ref(serial_mutex), std::ref(files), i, threadcount,
+                             std::cref(config), std::ref(latencies[i]));
+    for (std::thread &thread : threads)
+        thread.join();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const int ret = monitor.close_delta();
+    for (const auto &file : files)
+        close(file->inodefd);
+    if (ret == -1)
+        return -1;
+
+    for (const std::vector<double> &threadlatencies : latencies)
+        result.latencies.insert(result.latencies.end(), threadlatencies.begin(), threadlatencies.end());
+    std::sort(result.latencies.begin(), result.latencies.end());
+
+    boost::filesystem::remove_all(rootdir);
+    return 0;
+}
+
+int parse_option(bench_config &config, const std::string &option)
+{
+    const size_t eqpos = option.find('=');
+    if (option.compare(0, 2, "--") != 0 || eqpos == std::string::npos)
+        return -1;
+
+    const std::string name = option.substr(2, eqpos - 2);
+    const std::string value = option.substr(eqpos + 1);
+    uint64_t number = 0;
+
+    if (name == "copy" && value == "kernel")
+        config.monitor.copymode = copy_mode::KERNEL;
+    else if (name == "copy" && value == "buffered")
+        config.monitor.copymode = copy_mode::BUFFERED;
+    else if (name == "copy" && value == "uring")
+        config.monitor.copymode = copy_mode::URING;
+    else if (name == "threads" && parse_number(number, value, 1, MAX_BENCH_THREADS) == 0)
+        config.maxthreads = number;
+    else if (name == "files" && parse_number(number, value, 1, MAX_BENCH_FILES) == 0)
+        config.filecount = number;
+    else if (name == "filesize" && parse_number(number, value, 1, SIZE_MAX / (1024 * 1024)) == 0)
+        config.filesize = number * 1024 * 1024;
+    else if (name == "stride" && parse_number(number, value, BLOCK_SIZE, SIZE_MAX) == 0)
+        config.stride = number;
+    else if (name == "cache" && (value == "hot" || value == "cold"))
+        config.cold = value == "cold";
+    else if (name == "locking" && (value == "striped" || value == "serial"))
+        config.serial = value == "serial";
+    else
+        return -1;
+
+    return 0;
+}
+
+} // namespace statefs
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <scratch dir> [--threads=8] [--files=32] [--filesize=<MB>] [--stride=<bytes>]"
+                  << " [--copy=buffered|kernel|uring] [--cache=hot|cold] [--locking=striped|serial]\n";
+        exit(1);
+    }
+
+    statefs::bench_config config;
+    for (int i = 2; i < argc; i++)
+    {
+        if (statefs::parse_option(config, argv[i]) == -1)
+        {
+            std::cerr << "Incorrect argument " << argv[i] << "\n";
+            exit(1);
+        }
+    }
+
+    const size_t writes = config.filecount * ((config.filesize + config.stride - 1) / config.stride);
+    std::cout << "threads  writes/s  p50(us)  p99(us)\n";
+    for (size_t threadcount = 1; threadcount <= config.maxthreads; threadcount *= 2)
+    {
+        statefs::bench_result result;
+        if (statefs::run_session(result, std::string(argv[1]) + "/bench", threadcount, config) == -1)
+            exit(1);
+
+        std::cout << threadcount << "  " << (uint64_t)(writes / result.seconds) << "  "
+                  << result.latencies[result.latencies.size() / 2] << "  "
+                  << result.latencies[result.latencies.size() * 99 / 100] << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include <thread>
+#include <chrono>
+#include "op_gate.hpp"
+
+namespace statefs
+{
+
+/**
+ * Counts an operation in flight. Blocks while the gate is closed.
+ * @param writeback Whether the operation writes back pages cached by the kernel. Such operations also pass
+ *                  the closed gate while it is being flushed.
+ * @return The counter the operation is counted on. Must be passed to exit().
+ */
+size_t op_gate::enter(const bool writeback)
+{
+    static std::atomic<size_t> nextstripe{0};
+    thread_local const size_t stripeidx = nextstripe++ % GATE_STRIPE_COUNT;
+
+    while (true)
+    {
+        // Counting first and then checking the gate pairs with close() closing first and then checking the
+        // counts. Either the operation sees the gate closed or close() sees the operation.
+        stripes[stripeidx].inflight.fetch_add(1, std::memory_order_seq_cst);
+        if (!closed.load(std::memory_order_seq_cst) || (writeback && writebackopen.load(std::memory_order_seq_cst)))
+            return stripeidx;
+
+        stripes[stripeidx].inflight.fetch_sub(1, std::memory_order_release);
+        std::unique_lock<std::mutex> lock(mutex);
+        opencv.wait(lock, [&] { return !closed.load() || (writeback && writebackopen.load()); });
+    }
+}
+
+/**
+ * Marks an operation counted with enter() as completed.
+ */
+void op_gate::exit(const size_t stripeidx)
+{
+    stripes[stripeidx].inflight.fetch_sub(1, std::memory_order_release);
+}
+
+/**
+ * Holds off new operations and waits until the ones in flight are completed.
+ */
+void op_gate::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed.store(true, std::memory_order_seq_cst);
+    }
+    drain();
+}
+
+/**
+ * Lets writeback through the closed gate while the given function syncs the file system, so pages dirtied
+ * by operations which were in flight when the gate closed get written back. Returns once that writeback
+ * has completed. Other operations stay held off throughout.
+ * @param sync Writes back the dirty pages and waits for it (eg. syncfs of the mount).
+ */
+void op_gate::flush(const std::function<void()> &sync)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        writebackopen.store(true, std::memory_order_seq_cst);
+    }
+    opencv.notify_all();
+
+    sync();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        writebackopen.store(false, std::memory_order_seq_cst);
+    }
+    drain();
+}
+
+/**
+ * Waits until no operation is in flight. The gate must be closed.
+ */
+void op_gate::drain()
+{
+    const auto is_drained = [&]() {
+        for (const stripe &s : stripes)
+        {
+            if (s.inflight.load(std::memory_order_seq_cst) != 0)
+                return false;
+        }
+        return true;
+    };
+    while (!is_drained())
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+/**
+ * Lets the operations held off by close() continue.
+ */
+void op_gate::open()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed.store(false, std::memory_order_seq_cst);
+    }
+    opencv.notify_all();
+}
+
+} // namespace statefs
@@ -0,0 +1,58 @@
+#ifndef _STATEFS_OP_GATE_
+#define _STATEFS_OP_GATE_
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace statefs
+{
+
+// No. of counters file system operations in flight are spread over. Threads are assigned to them round robin.
+constexpr size_t GATE_STRIPE_COUNT = 64;
+
+// Lets file system operations run concurrently while allowing a checkpoint to hold them all off briefly.
+// Each thread counts its operations in flight on its own cache line, so passing the gate costs an
+// uncontended atomic add rather than a shared lock.
+class op_gate
+{
+private:
+    struct alignas(64) stripe
+    {
+        std::atomic<int64_t> inflight{0};
+    };
+
+    stripe stripes[GATE_STRIPE_COUNT];
+    std::atomic<bool> closed{false};
+    std::atomic<bool> writebackopen{false}; // Writeback of the kernel page cache passes the closed gate while set.
+    std::mutex mutex;
+    std::condition_variable opencv; // Notified when the gate opens again, or opens for writeback.
+
+    void drain();
+
+public:
+    size_t enter(const bool writeback = false);
+    void exit(const size_t stripeidx);
+    void close();
+    void flush(const std::function<void()> &sync);
+    void open();
+};
+
+// Holds a file system operation within the gate for the lifetime of the scope.
+class op_scope
+{
+private:
+    op_gate &gate;
+    const size_t stripeidx;
+
+public:
+    op_scope(op_gate &gate, const bool writeback = false) : gate(gate), stripeidx(gate.enter(writeback)) {}
+    ~op_scope() { gate.exit(stripeidx); }
+};
+
+} // namespace statefs
+
+#endif
@@ -6,7 +6,10 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include <cmath>
+#include <thread>
 #include <boost/filesystem.hpp>
 #include <fstream>
 #include <sstream>
@@ -14,497 +17,1819 @@
 #include <errno.h>
 #include "../hasher.hpp"
 #include "../state_common.hpp"
+#include "../reflink.hpp"
+#include "../delta_manifest.hpp"
+#include "../state_restore.hpp"
 #include "state_monitor.hpp"
 
 namespace statefs
 {
 
-void state_monitor::create_checkpoint()
+state_monitor::~state_monitor()
 {
-    // Shift -1 and below checkpoints by 1 more.
-    // If MAX oldest checkpoint is there, remove it and work our way upwards.
-    int16_t oldest_chkpnt = (MAX_CHECKPOINTS + 1) * -1; // +1 because we maintain one extra checkpoint in case of rollbacks.
-    for (int16_t chkpnt = oldest_chkpnt; chkpnt <= -1; chkpnt++)
+    if (purgethread.joinable())
+        purgethread.join();
+}
+
+/**
+ * Prepares the monitor for a session with the current config. Must be called after any checkpoint is
+ * created. If the delta already holds the session of an earlier run, we continue from where it stopped.
+ * @param reflink_capable Whether the state dir file system supports reflinks.
+ */
+void state_monitor::init(const bool reflink_capable)
+{
+    reflink_supported = config.reflink && reflink_capable;
+    fdpool.set_capacity(config.fdpoolsize);
+    open_blockstore();
+
+    // Retention may have been lowered since the last checkpoint. Earlier runs may also have left expired
+    // generations behind.
+    checkpoint_window window;
+    if (read_checkpoint_window(window) == 0)
+        apply_retention(window);
+
+    read_newfileindex();
+    resume_session();
+}
+
+/**
+ * Starts a new checkpoint. The current session delta becomes the latest earlier checkpoint and the session
+ * continues in the delta of a new generation. Generations which fall out of the retained window are
+ * deleted in the background.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::create_checkpoint()
+{
+    // References of the generations about to expire must be counted before they get released. Purges only
+    // start once the block store has been opened (or found not to be needed).
+    open_blockstore();
+
+    checkpoint_window window;
+    if (read_checkpoint_window(window) == -1)
+        return -1;
+
+    window.current = window.next++;
+    const std::string deltadir = get_generation_deltadir(window.current);
+    boost::filesystem::create_directories(deltadir);
+    if (apply_retention(window) == -1)
+        return -1;
+
+    ctx.deltadir = deltadir;
+    return 0;
+}
+
+/**
+ * Cuts a checkpoint while the file system stays mounted. The session delta is completed, the checkpoint is
+ * created and tracking starts over against the new checkpoint. Must be called while the gate holds off file
+ * system operations and after the kernel has written back the pages dirtied before the checkpoint.
+ * @param generation Set to the generation of the checkpoint which was cut.
+ * @param detach_slots Detaches the tracking records from all the file system inodes.
+ * @return 0 on successful execution. -1 on failure. The session continues in the same delta on failure.
+ */
+int state_monitor::cut_checkpoint(uint64_t &generation, const std::function<void()> &detach_slots)
+{
+    // A checkpoint is not cut on top of a delta with blocks missing their hashes or stored form.
+    if (close_delta() == -1)
+    {
+        std::cerr << "Completing the session delta failed. Checkpoint not cut.\n";
+        return -1;
+    }
+
+    checkpoint_window window;
+    if (read_checkpoint_window(window) == -1 || create_checkpoint() == -1)
+        return -1;
+
+    detach_slots();
+    reset_tracking();
+    generation = window.current;
+    return 0;
+}
+
+/**
+ * Rolls the state back to the latest checkpoint while the file system stays mounted. The session delta is
+ * restored and the session starts over on top of the checkpoint. Must be called while the gate holds off file
+ * system operations and after the kernel has written back its dirty pages. The kernel caches of the touched
+ * paths must be dropped before operations are let through again.
+ * @param touchedpaths Set to the relative paths of the files the rollback may have changed, removed or brought back.
+ * @param detach_slots Detaches the tracking records from all the file system inodes.
+ * @return 0 on successful execution. -1 on failure. The monitor exits if the failure comes after the state got changed.
+ */
+int state_monitor::rollback_checkpoint(std::vector<std::string> &touchedpaths, const std::function<void()> &detach_slots)
+{
+    // Block hashes are not needed to undo the delta, which is discarded afterwards. So a hash failure is ignored here.
+    close_delta();
+
+    delta_manifest manifest;
+    checkpoint_window window;
+    if (read_delta_manifest(manifest, ctx.deltadir) == -1 || read_checkpoint_window(window) == -1)
+        return -1;
+
+    for (const delta_file &file : manifest.files)
+    {
+        touchedpaths.push_back(file.relpath);
+        if (file.currentpath != file.relpath && !file.deleted)
+            touchedpaths.push_back(file.currentpath);
+    }
+    for (const delta_rename &rename : manifest.renames)
+    {
+        touchedpaths.push_back(rename.from);
+        touchedpaths.push_back(rename.to);
+    }
+    touchedpaths.insert(touchedpaths.end(), newfiles.begin(), newfiles.end());
+
+    // A failure before the restore changes anything leaves the delta and the tracking state as they were, so the
+    // rollback can be retried.
+    state_restore restore;
+    if (restore.rollback() == -1)
+    {
+        if (!restore.changed)
+            return -1;
+        fail_rollback();
+    }
+
+    detach_slots();
+    reset_tracking();
+    blockstore.release(manifest.storerefs);
+
+    // The session starts over in a new generation on top of the checkpoint, the same as a restart would.
+    // If there was no earlier checkpoint the restore has already moved the session to a new generation.
+    const uint64_t rolledback = window.current;
+    if (read_checkpoint_window(window) == -1)
+        fail_rollback();
+    if (window.current < rolledback)
+    {
+        if (create_checkpoint() == -1)
+            fail_rollback();
+    }
+    else
+    {
+        ctx.deltadir = get_generation_deltadir(window.current);
+    }
+
+    return 0;
+}
+
+/**
+ * Stops the monitor after a rollback which got past the point of changing the state did not complete. The state
+ * is then neither the one of the session nor the checkpoint, or the monitor has no delta to preserve changes to
+ * it in. No more operations may be let through on top of it. The process exits right away since the fuse
+ * threads are still running.
+ */
+void state_monitor::fail_rollback()
+{
+    std::cerr << "Rollback failed part way through. The state is partly rolled back. Stopping the monitor.\n";
+    _exit(1);
+}
+
+/**
+ * Tracks a file created during the session so restore deletes it.
+ * @return 0 on successful execution. -1 if the file could not be recorded as new.
+ */
+int state_monitor::oncreate(fileinfo_slot &slot, const int fd)
+{
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0)
+    {
+        std::cerr << errno << ": Error occured in fstat() of fd " << fd << "\n";
+        return -1;
+    }
+
+    // Add an entry for the new file in the file info map. This information will be used to ignore
+    // future operations (eg. write/delete) done to this file. If the inode no. was previously used
+    // by a deleted file, the new file replaces it.
+    std::shared_ptr<state_file_info> fi = std::make_shared<state_file_info>();
+    fi->isnew = true;
+    fi->trackingid = ++lasttrackingid;
+    if (extract_filepath(fi->filepath, fd) != 0)
+        return -1;
+
+    // Add to the list of new files added during this session.
+    if (write_newfileentry(fi->filepath) != 0)
+        return -1;
+
+    {
+        const SrcId id(stat_buf.st_ino, stat_buf.st_dev);
+        fileinfo_shard &shard = get_fileinfo_shard(id);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto spillitr = shard.spilled.find(id);
+        if (spillitr != shard.spilled.end())
+        {
+            spill.release(spillitr->second);
+            shard.spilled.erase(spillitr);
+            stats.trackedfiles--;
+            stats.spilledfiles--;
+        }
+        if (shard.fileinfomap.insert_or_assign(id, fi).second)
+            stats.trackedfiles++;
+    }
+
+    std::atomic_store(&slot.fileinfo, fi);
+    slot.preservelimit.store(0, std::memory_order_release);
+    return 0;
+}
+
+void state_monitor::onopen(fileinfo_slot &slot, const int inodefd, const int flags)
+{
+    std::shared_ptr<state_file_info> fi;
+    // Check whether fd is open in truncate mode. If so cache the entire file immediately.
+    // With reflink support this shares the extents of the file instead of copying them.
+    if ((flags & O_TRUNC) && get_attached_fileinfo(fi, slot, inodefd) == 0)
+    {
+        std::lock_guard<std::mutex> lock(fi->m);
+        cache_blocks(*fi, {inodefd, NULL}, 0, fi->original_length);
+        update_preservelimit(slot, *fi);
+    }
+}
+
+void state_monitor::onwrite(fileinfo_slot &slot, const int inodefd, const off_t offset, const size_t length)
+{
+    // Writes into regions which have nothing left to preserve return right away without any locks.
+    stats.writes.fetch_add(1, std::memory_order_relaxed);
+    const off_t limit = slot.preservelimit.load(std::memory_order_acquire);
+    if (limit != -1 && offset >= limit)
+    {
+        stats.fastpathwrites.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::shared_ptr<state_file_info> fi;
+    if (get_attached_fileinfo(fi, slot, inodefd) == 0)
+    {
+        std::lock_guard<std::mutex> lock(fi->m);
+        cache_blocks(*fi, {inodefd, NULL}, offset, length);
+        update_preservelimit(slot, *fi);
+    }
+}
+
+/**
+ * Records a rename of a file before it happens. The rename must not go ahead if this fails, or the
+ * original file would be at a path the delta knows nothing about.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::onrename(const int parentfd, const char *name, const int newparentfd, const char *newname)
+{
+    struct stat stat_buf, newstat_buf;
+    if (fstatat(parentfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(stat_buf.st_mode))
+        return 0;
+
+    // If an existing file gets replaced by the rename, it is going away just like a delete.
+    // Renaming a file onto another link of itself does nothing.
+    if (fstatat(newparentfd, newname, &newstat_buf, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        if (newstat_buf.st_ino == stat_buf.st_ino && newstat_buf.st_dev == stat_buf.st_dev)
+            return 0;
+        if (ondelete(newparentfd, newname) != 0)
+            return -1;
+    }
+
+    std::shared_ptr<state_file_info> fi;
+    std::string newfilepath;
+    if (get_tracked_fileinfo(fi, stat_buf) != 0 || resolve_filepath(newfilepath, {newparentfd, newname}) != 0)
+        return -1;
+
+    std::lock_guard<std::mutex> lock(fi->m);
+    if (fi->isnew)
+    {
+        // New file simply moves to the new path in the new files index.
+        if (remove_newfileentry(fi->filepath) != 0)
+            return -1;
+        fi->filepath = newfilepath;
+        return write_newfileentry(newfilepath);
+    }
+    else if (write_renamerecord(*fi, {parentfd, name}, newfilepath) != 0)
+    {
+        // If the rename could not be recorded, cache the entire file under its original path
+        // and treat the new path as a new file.
+        if (cache_blocks(*fi, {parentfd, name}, 0, fi->original_length) != 0)
+            return -1;
+        return write_newfileentry(newfilepath);
+    }
+    return 0;
+}
+
+/**
+ * Preserves a file before its link is removed. The delete must not go ahead if this fails.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::ondelete(const int parentfd, const char *name)
+{
+    struct stat stat_buf;
+    if (fstatat(parentfd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(stat_buf.st_mode))
+        return 0;
+
+    std::shared_ptr<state_file_info> fi;
+    if (get_tracked_fileinfo(fi, stat_buf) != 0)
+        return -1;
+
+    {
+        std::lock_guard<std::mutex> lock(fi->m);
+        if (fi->isnew)
+        {
+            // If this is a new file, just remove from existing index entries.
+            // No need to cache the file blocks.
+            if (remove_newfileentry(fi->filepath) != 0)
+                return -1;
+        }
+        else if (!config.linkdeleted || stat_buf.st_nlink > 1 || link_deleted(*fi, {parentfd, name}) != 0)
+        {
+            // If not a new file, cache the entire file. We do this when the inode survives the delete
+            // through another link (it can still change) or when it could not be linked into the delta.
+            if (cache_blocks(*fi, {parentfd, name}, 0, fi->original_length) != 0 ||
+                write_renamerecord(*fi, {parentfd, name}, "") != 0)
+                return -1;
+        }
+    }
+
+    untrack_fileinfo(fi, stat_buf);
+    return 0;
+}
+
+void state_monitor::ontruncate(fileinfo_slot &slot, const int inodefd, const off_t newsize)
+{
+    // If truncated size is less than the original, cache the original blocks which are getting lost.
+    // The blocks before the new size are left intact and get cached upon writes like any other block.
+    // Extending the file only needs the file record, so restore truncates it back to the original length.
+    std::shared_ptr<state_file_info> fi;
+    if (get_attached_fileinfo(fi, slot, inodefd) == 0 && newsize != fi->original_length)
+    {
+        std::lock_guard<std::mutex> lock(fi->m);
+        if (newsize < fi->original_length)
+            cache_blocks(*fi, {inodefd, NULL}, newsize, fi->original_length - newsize);
+        else if (!fi->isnew)
+            prepare_caching(*fi, {inodefd, NULL});
+        update_preservelimit(slot, *fi);
+    }
+}
+
+void state_monitor::onfallocate(fileinfo_slot &slot, const int inodefd, const int mode, const off_t offset, const off_t length)
+{
+    // Plain allocation (with or without keeping the size) and unsharing leave the data as is. Punching holes
+    // and zeroing change the given range. Collapsing and inserting ranges shift everything after the offset.
+    // Allocating beyond the end without FALLOC_FL_KEEP_SIZE also grows the file.
+    off_t end = 0;
+    if (mode & (FALLOC_FL_COLLAPSE_RANGE | FALLOC_FL_INSERT_RANGE))
+        end = LLONG_MAX;
+    else if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        end = offset + length;
+    const bool keepsize = mode & FALLOC_FL_KEEP_SIZE;
+    if (end == 0 && keepsize)
+        return;
+
+    std::shared_ptr<state_file_info> fi;
+    if (get_attached_fileinfo(fi, slot, inodefd) != 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(fi->m);
+    if (end > offset && offset < fi->original_length)
+        cache_blocks(*fi, {inodefd, NULL}, offset, std::min(end, fi->original_length) - offset);
+    else if (!keepsize && offset + length > fi->original_length && !fi->isnew)
+        prepare_caching(*fi, {inodefd, NULL}); // Only the file record, so restore truncates the file back.
+    update_preservelimit(slot, *fi);
+}
+
+/**
+ * Completes the pending block hashes, writes out the new files index and closes the delta files.
+ * They are reopened if another block gets preserved afterwards.
+ * @return 0 on successful execution. -1 if a hash job of the delta failed or the index could not be written.
+ */
+int state_monitor::close_delta()
+{
+    int ret = hashpool.wait();
+
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (write_newfileindex() == -1)
+        ret = -1;
+
+    if (segmentfd != -1)
+        close(segmentfd);
+    if (manifestfd != -1)
+        close(manifestfd);
+    segmentfd = manifestfd = -1;
+    links_dir_created = false;
+    return ret;
+}
+
+/**
+ * Prints the session counters of the state monitor.
+ */
+void state_monitor::print_stats(std::ostream &out)
+{
+    out << "Tracked files: " << stats.trackedfiles << "\n"
+        << "Cached blocks: " << stats.cachedblocks << "\n"
+        << "Cached block bitmap memory: " << block_bitmap::total_memory_usage() << " bytes\n"
+        << "Deleted files linked: " << stats.linkedfiles << "\n"
+        << "Renames recorded: " << stats.renamedfiles << "\n"
+        << "Resumed files: " << stats.resumedfiles << "\n"
+        << "Fast path writes: " << stats.fastpathwrites << " of " << stats.writes << "\n"
+        << "Zero blocks: " << stats.zeroblocks << "\n";
+    if (stats.compressioninput > 0)
+    {
+        out << "Block compression: " << stats.compressioninput << " -> " << stats.compressionoutput << " bytes (ratio "
+            << (double)stats.compressioninput / stats.compressionoutput << ", "
+            << (stats.compressionnanos > 0 ? stats.compressioninput * 1000.0 / stats.compressionnanos : 0) << " MB/s)\n";
+    }
+    if (stats.storeblocks > 0)
+    {
+        out << "Deduplicated blocks: " << stats.dedupblocks << " of " << stats.storeblocks << " (ratio "
+            << (double)stats.storeblocks / std::max<uint64_t>(1, stats.storeblocks - stats.dedupblocks) << ")\n";
+    }
+    if (blockstore.is_open())
+        out << "Block store: " << blockstore.size() << " blocks (" << blockstore.bytes() << " bytes)\n";
+    out << "Spilled tracking records: " << stats.spilledfiles << " (" << spill.live_size() << " of " << spill.size() << " spill file bytes in use)\n"
+        << "Pooled read fds: " << fdpool.size() << " (" << fdpool.opens() << " opens)\n";
+}
+
+/**
+ * Returns the lock stripe of the file id-->fileinfo map which holds the given file id.
+ */
+fileinfo_shard &state_monitor::get_fileinfo_shard(const SrcId &id)
+{
+    return fileinfoshards[std::hash<SrcId>{}(id) % MONITOR_SHARD_COUNT];
+}
+
+/**
+ * Extracts the full physical file path for a given fd.
+ * @param filepath String to assign the extracted file path.
+ * @param fd The file descriptor to find the filepath.
+ * @return 0 on successful file path extraction. -1 on failure.
+ */
+int state_monitor::extract_filepath(std::string &filepath, const int fd)
+{
+    char proclnk[32];
+    sprintf(proclnk, "/proc/self/fd/%d", fd);
+
+    filepath.resize(PATH_MAX);
+    ssize_t len = readlink(proclnk, filepath.data(), PATH_MAX);
+    if (len > 0)
+    {
+        filepath.resize(len);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Resolves the full physical file path of the given file reference.
+ * @param filepath String to assign the resolved file path.
+ * @param ref The file reference. If it has a name we concat the parent dir path and the name.
+ * @return 0 on successful file path resolution. -1 on failure.
+ */
+int state_monitor::resolve_filepath(std::string &filepath, const file_ref &ref)
+{
+    if (extract_filepath(filepath, ref.fd) != 0)
+        return -1;
+
+    if (ref.name != NULL)
+        filepath.append("/").append(ref.name);
+    return 0;
+}
+
+/**
+ * Finds the tracked state file information for the given file.
+ * @param fi Reference to assign the state file info struct.
+ * @param stat_buf Stat of the file. Used to identify the file and get its original length.
+ * @return 0 on successful find. -1 on failure.
+ */
+int state_monitor::get_tracked_fileinfo(std::shared_ptr<state_file_info> &fi, const struct stat &stat_buf)
+{
+    const SrcId id(stat_buf.st_ino, stat_buf.st_dev);
+    fileinfo_shard &shard = get_fileinfo_shard(id);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        // Return from file id-->fileinfo map if found.
+        const auto itr = shard.fileinfomap.find(id);
+        if (itr != shard.fileinfomap.end())
+        {
+            fi = itr->second;
+            return 0;
+        }
+
+        // Bring the record back into memory if it was spilled.
+        const auto spillitr = shard.spilled.find(id);
+        if (spillitr != shard.spilled.end())
+        {
+            std::vector<char> record;
+            if (spill.read(record, spillitr->second) != 0 || thaw_fileinfo(fi, record) != 0)
+                return -1;
+
+            spill.release(spillitr->second);
+            shard.spilled.erase(spillitr);
+            shard.fileinfomap.emplace(id, fi);
+            stats.spilledfiles--;
+        }
+        else
+        {
+            // Initialize a new state file info struct for the given file. The file cannot be modified through
+            // us before it gets tracked, so the stat length is still the original length.
+            fi = std::make_shared<state_file_info>();
+            fi->original_length = stat_buf.st_size;
+            fi->sparse = stat_buf.st_blocks * 512 < stat_buf.st_size;
+            fi->trackingid = ++lasttrackingid;
+            fi->blocksize = config.blocksize != 0 ? config.blocksize : get_blocksize(fi->original_length);
+            fi->cached_blocks.reset(ceil((double)fi->original_length / (double)fi->blocksize));
+            shard.fileinfomap.emplace(id, fi);
+            stats.trackedfiles++;
+        }
+    }
+
+    if (config.trackmemory > 0 && tracking_memory() > (int64_t)config.trackmemory)
+        trim_tracking();
+
+    return 0;
+}
+
+/**
+ * Returns the tracking record attached to a file system inode. If the inode does not have one yet
+ * we find the tracked state file information and attach it.
+ * @param fi Reference to assign the state file info struct.
+ * @param slot The fileinfo slot of the file system inode.
+ * @param inodefd The inode fd of the file.
+ * @return 0 on successful find. -1 on failure.
+ */
+int state_monitor::get_attached_fileinfo(std::shared_ptr<state_file_info> &fi, fileinfo_slot &slot, const int inodefd)
+{
+    fi = std::atomic_load(&slot.fileinfo);
+    if (fi)
+        return 0;
+
+    struct stat stat_buf;
+    if (fstatat(inodefd, "", &stat_buf, AT_EMPTY_PATH) != 0)
+    {
+        std::cerr << errno << ": Error occured in fstat() of inode fd " << inodefd << "\n";
+        return -1;
+    }
+
+    if (get_tracked_fileinfo(fi, stat_buf) != 0)
+        return -1;
+
+    std::atomic_store(&slot.fileinfo, fi);
+    // New files never need preservation. For other files the limit is published by update_preservelimit()
+    // once the file record exists, so the first write past the original length still takes the slow path.
+    if (fi->isnew)
+        slot.preservelimit.store(0, std::memory_order_release);
+    return 0;
+}
+
+/**
+ * Publishes the preservation limit of the inode slot. Writes at or beyond the limit skip the monitor. It is the
+ * original length once the file record is in the delta and drops to 0 once all original blocks are preserved.
+ * Must be called while holding the lock of the tracking record.
+ * @param slot Inode slot the record is attached to.
+ * @param fi Tracking record of the file.
+ */
+void state_monitor::update_preservelimit(fileinfo_slot &slot, state_file_info &fi)
+{
+    // Without the file record even writes beyond the original length must reach the monitor.
+    if (fi.deltafileid == 0)
+        return;
+
+    slot.preservelimit.store(fi.cached_blocks.full() ? 0 : fi.original_length, std::memory_order_release);
+}
+
+/**
+ * Stops tracking a file whose last link is being removed. The inode no. may get reused for
+ * another file after this. Inodes already holding the record keep using it.
+ */
+void state_monitor::untrack_fileinfo(const std::shared_ptr<state_file_info> &fi, const struct stat &stat_buf)
+{
+    if (stat_buf.st_nlink > 1)
+        return;
+
+    const SrcId id(stat_buf.st_ino, stat_buf.st_dev);
+    fileinfo_shard &shard = get_fileinfo_shard(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    const auto itr = shard.fileinfomap.find(id);
+    if (itr != shard.fileinfomap.end() && itr->second == fi)
+    {
+        shard.fileinfomap.erase(itr);
+        stats.trackedfiles--;
+    }
+
+    // The file is gone. Do not keep its inode alive through a pooled fd.
+    fdpool.evict(fi->trackingid);
+}
+
+/**
+ * Returns the approx. memory held by the in-memory tracking records.
+ */
+int64_t state_monitor::tracking_memory()
+{
+    return (stats.trackedfiles - stats.spilledfiles) * (int64_t)TRACKED_RECORD_SIZE + block_bitmap::total_memory_usage();
+}
+
+/**
+ * Spills cold tracking records to disk until the tracking memory is back within the budget. A record is cold
+ * if no file system inode is attached to it and no operation is using it (the map holds the only reference).
+ * Nobody else can get hold of a record without its shard lock, so it is safe to evict under the lock.
+ */
+void state_monitor::trim_tracking()
+{
+    std::unique_lock<std::mutex> trimlock(trim_mutex, std::try_to_lock);
+    if (!trimlock.owns_lock() || spill.open(ctx.deltadir) != 0)
+        return;
+
+    // Trim somewhat below the budget so we do not trim again with the next new record.
+    const int64_t target = config.trackmemory - config.trackmemory / 8;
+
+    std::vector<char> record;
+    for (size_t visited = 0; visited < MONITOR_SHARD_COUNT && tracking_memory() > target; visited++)
     {
-        std::string dir = get_statedir_root(chkpnt);
+        fileinfo_shard &shard = fileinfoshards[trimcursor];
+        trimcursor = (trimcursor + 1) % MONITOR_SHARD_COUNT;
 
-        if (boost::filesystem::exists(dir))
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        for (auto itr = shard.fileinfomap.begin(); itr != shard.fileinfomap.end() && tracking_memory() > target;)
         {
-            if (chkpnt == oldest_chkpnt)
+            if (itr->second.use_count() > 1)
             {
-                boost::filesystem::remove_all(dir);
+                itr++;
+                continue;
             }
-            else
+
+            freeze_fileinfo(record, *itr->second);
+            const off_t offset = spill.write(record);
+            if (offset == -1)
+                return;
+
+            fdpool.evict(itr->second->trackingid);
+            shard.spilled.emplace(itr->first, offset);
+            stats.spilledfiles++;
+            itr = shard.fileinfomap.erase(itr);
+        }
+    }
+}
+
+/**
+ * Serializes a tracking record into its frozen form.
+ * Format: [flags(1 byte): isnew, sparse | original length(8 bytes) | block size(4 bytes) | delta file id(4 bytes) |
+ *          block count(4 bytes) | cached block count(4 bytes) | word count(4 bytes) | bitmap words | path]
+ */
+void state_monitor::freeze_fileinfo(std::vector<char> &record, const state_file_info &fi)
+{
+    const std::vector<uint64_t> &words = fi.cached_blocks.get_words();
+    const uint32_t blockcount = fi.cached_blocks.size(), setcount = fi.cached_blocks.count(), wordcount = words.size();
+    const size_t wordsbytes = wordcount * sizeof(uint64_t);
+
+    record.resize(29 + wordsbytes + fi.filepath.size());
+    char *ptr = record.data();
+    ptr[0] = (fi.isnew ? 1 : 0) | (fi.sparse ? 2 : 0);
+    memcpy(ptr + 1, &fi.original_length, 8);
+    memcpy(ptr + 9, &fi.blocksize, 4);
+    memcpy(ptr + 13, &fi.deltafileid, 4);
+    memcpy(ptr + 17, &blockcount, 4);
+    memcpy(ptr + 21, &setcount, 4);
+    memcpy(ptr + 25, &wordcount, 4);
+    memcpy(ptr + 29, words.data(), wordsbytes);
+    memcpy(ptr + 29 + wordsbytes, fi.filepath.data(), fi.filepath.size());
+}
+
+/**
+ * Recreates a tracking record from its frozen form.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::thaw_fileinfo(std::shared_ptr<state_file_info> &fi, const std::vector<char> &record)
+{
+    uint32_t blockcount = 0, setcount = 0, wordcount = 0;
+    if (record.size() >= 29)
+        memcpy(&wordcount, record.data() + 25, 4);
+    const size_t wordsbytes = wordcount * sizeof(uint64_t);
+    if (record.size() < 29 + wordsbytes)
+    {
+        std::cerr << "Invalid tracking record in spill\n";
+        return -1;
+    }
+
+    fi = std::make_shared<state_file_info>();
+    const char *ptr = record.data();
+    fi->isnew = ptr[0] & 1;
+    fi->sparse = ptr[0] & 2;
+    memcpy(&fi->original_length, ptr + 1, 8);
+    memcpy(&fi->blocksize, ptr + 9, 4);
+    memcpy(&fi->deltafileid, ptr + 13, 4);
+    memcpy(&blockcount, ptr + 17, 4);
+    memcpy(&setcount, ptr + 21, 4);
+    std::vector<uint64_t> words(wordcount);
+    memcpy(words.data(), ptr + 29, wordsbytes);
+    fi->cached_blocks.assign(blockcount, setcount, std::move(words));
+    fi->filepath.assign(ptr + 29 + wordsbytes, record.size() - 29 - wordsbytes);
+    fi->trackingid = ++lasttrackingid;
+    return 0;
+}
+
+/**
+ * Caches the specified bytes range of the given file.
+ * @param fi The file info struct pointing to the file to be cached.
+ * @param ref Reference to the file on disk. Used to resolve the file path if not resolved yet.
+ * @param offset The start byte position for caching.
+ * @param length How many bytes to cache.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::cache_blocks(state_file_info &fi, const file_ref &ref, const off_t offset, const size_t length)
+{
+    // No caching required if this is a new file created during this session.
+    if (fi.isnew)
+        return 0;
+
+    if (length == 0)
+        return 0;
+
+    // Initialize the delta records required for caching. The file gets its record even if nothing needs
+    // to be cached (eg. appends), so restore knows to truncate it back to the original length.
+    if (prepare_caching(fi, ref) != 0)
+        return -1;
+
+    const uint32_t original_blockcount = fi.cached_blocks.size();
+
+    // Check whether we have already cached the entire file.
+    if (fi.cached_blocks.full())
+        return 0;
+
+    // Return if incoming write is outside any of the original blocks.
+    if (offset >= (off_t)original_blockcount * fi.blocksize)
+        return 0;
+
+    // Get a read fd of the file from the pool. This fd will be used to fetch blocks to be cached.
+    fd_lease readfd(fdpool, fi.trackingid, [&]() { return open_readfd(ref); });
+    if (readfd.get() == -1)
+    {
+        std::cerr << errno << ": Open failed " << fi.filepath << "\n";
+        return -1;
+    }
+
+    const int ret = with_blocksize(fi.blocksize, [&](auto blocksize) {
+        return cache_blockruns<decltype(blocksize)::value>(fi, readfd.get(), offset, length);
+    });
+    if (ret != 0)
+        return -1;
+
+    // Once all the original blocks are preserved the file will not be read again.
+    if (fi.cached_blocks.full())
+        readfd.evict_on_release();
+
+    return 0;
+}
+
+/**
+ * Caches the uncached original blocks of the given file within the specified bytes range.
+ * Instantiated per block size so the block arithmetic is as cheap as with a constexpr block size.
+ * @param fi The file info struct pointing to the file to be cached. Its block size must be BS.
+ * @param readfd Read fd of the file.
+ * @param offset The start byte position for caching.
+ * @param length How many bytes to cache.
+ * @return 0 on successful execution. -1 on failure.
+ */
+template <size_t BS>
+int state_monitor::cache_blockruns(state_file_info &fi, const int readfd, const off_t offset, const size_t length)
+{
+    // Max. no. of blocks in a batch.
+    constexpr uint32_t BATCH_BLOCKS = COW_BATCH_SIZE > BS ? COW_BATCH_SIZE / BS : 1;
+
+    const uint32_t original_blockcount = fi.cached_blocks.size();
+
+    // Range of original blocks touched by this operation.
+    const uint32_t startblock = offset / BS;
+    const uint32_t endblock = std::min<uint64_t>((offset + length - 1) / BS, original_blockcount - 1);
+
+    // std::cout << "Cache blocks: '" << fi.filepath << "' [" << offset << "," << length << "] " << startblock << "," << endblock << "\n";
+
+    // We find contiguous runs of uncached blocks and read each run with a single read. Runs are packed
+    // back to back in the batch buffer so the whole batch goes to the segment and the manifest with one
+    // write each. Syscalls therefore scale with the no. of runs rather than the no. of blocks.
+    // In kernel copy mode, each whole run is copied straight into its own slot in the segment instead.
+    // Only its manifest records are batched. In io_uring mode the run reads and the segment write of a batch
+    // are chained on the ring of this thread and submitted together.
+    const bool kernelcopy = config.copymode == copy_mode::KERNEL;
+    uring_queue *uring = config.copymode == copy_mode::URING ? get_uring() : NULL;
+    thread_local std::vector<char> batchbuf;
+    std::vector<std::pair<uint32_t, off_t>> batchblocks, zeroblocks;
+    batchblocks.reserve(std::min<uint32_t>(endblock - startblock + 1, BATCH_BLOCKS));
+    hole_scanner holes(readfd);
+    const auto write_batch = [&]() {
+        if (uring != NULL)
+            return write_uringbatch(fi, *uring, batchblocks);
+        return write_cachebatch(fi, kernelcopy ? NULL : batchbuf.data(), batchblocks);
+    };
+
+    // Skip the blocks we have already cached.
+    uint32_t i = fi.cached_blocks.find_first_unset(startblock, endblock);
+    while (i <= endblock)
+    {
+        // Extend the run until the next cached block or until the batch buffer is full.
+        const uint32_t maxend = kernelcopy ? endblock : std::min<uint64_t>(endblock, (uint64_t)i + (BATCH_BLOCKS - batchblocks.size()) - 1);
+        uint32_t runend = fi.cached_blocks.find_first_set(i, maxend) - 1;
+
+        // Holes are preserved as zero blocks without copying anything. A run of data ends where the next hole starts.
+        if (fi.sparse)
+        {
+            if (holes.is_hole((off_t)i * BS, BS))
+            {
+                zeroblocks.clear();
+                for (uint32_t blockid = i; blockid <= runend && holes.is_hole((off_t)blockid * BS, BS); blockid++)
+                    zeroblocks.emplace_back(blockid, ZERO_BLOCK_OFFSET);
+                if (write_cachebatch(fi, NULL, zeroblocks) != 0)
+                    return -1;
+
+                i = fi.cached_blocks.find_first_unset(i + zeroblocks.size(), endblock);
+                continue;
+            }
+
+            for (uint32_t blockid = i + 1; blockid <= runend; blockid++)
             {
-                std::string dirshift = get_statedir_root(chkpnt - 1);
-                boost::filesystem::rename(dir, dirshift);
+                if (holes.is_hole((off_t)blockid * BS, BS))
+                {
+                    runend = blockid - 1;
+                    break;
+                }
             }
         }
 
-        if (chkpnt == -1)
+        const size_t runlength = (runend - i + 1) * BS;
+        const size_t bufoffset = batchblocks.size() * BS;
+
+        // Segment offset of the run. In buffered mode this is assigned when the batch is written.
+        off_t cacheoffset = 0;
+        if (kernelcopy)
+        {
+            cacheoffset = reserve_segment(runlength);
+            if (cacheoffset == -1 || copy_to_cache(fi, readfd, (off_t)i * BS, runlength, cacheoffset) != 0)
+                return -1;
+        }
+        else if (uring != NULL)
+        {
+            // Read only up to the original EOF since a short read would break the chain.
+            // Last block of the file may be partial. We always cache full blocks padded with zeros.
+            char *rundata = uring->buffer() + bufoffset;
+            const size_t readlength = std::min<off_t>(runlength, fi.original_length - (off_t)i * BS);
+            if (readlength < runlength)
+                memset(rundata + readlength, 0, runlength - readlength);
+            uring->queue_read(readfd, rundata, readlength, (off_t)i * BS);
+        }
+        else
         {
-            statedir_context ctx = get_statedir_context(0, true);
+            // Read the blocks being replaced into the batch buffer.
+            if (batchbuf.size() < bufoffset + runlength)
+                batchbuf.resize(BATCH_BLOCKS * BS);
 
-            // Shift 0-state delta dir to -1.
-            std::string delta_1 = dir + DELTA_DIR;
-            boost::filesystem::create_directories(delta_1);
+            const ssize_t res = pread(readfd, batchbuf.data() + bufoffset, runlength, (off_t)i * BS);
+            if (res < 0)
+            {
+                std::cerr << errno << ": Read failed " << fi.filepath << "\n";
+                return -1;
+            }
+
+            // Last block of the file may be partial. We always cache full blocks padded with zeros.
+            if ((size_t)res < runlength)
+                memset(batchbuf.data() + bufoffset + res, 0, runlength - res);
+        }
+
+        for (uint32_t blockid = i; blockid <= runend; blockid++)
+        {
+            batchblocks.emplace_back(blockid, cacheoffset);
+            if (kernelcopy)
+                cacheoffset += BS;
+
+            if (batchblocks.size() == BATCH_BLOCKS && write_batch() != 0)
+                return -1;
+        }
+
+        i = fi.cached_blocks.find_first_unset(runend + 1, endblock);
+    }
+
+    if (!batchblocks.empty() && write_batch() != 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Copies a range of original file bytes into the delta segment without going through userspace.
+ * If the file system supports reflinks we share the extents of the range with the segment. Otherwise
+ * we use copy_file_range and fall back to splice through a pipe if the file system does not support it.
+ * If neither is supported we fall back to read/write. The range beyond the original EOF is cached as zeros.
+ * @param fi The file info struct pointing to the file being cached.
+ * @param readfd Read fd of the file being cached.
+ * @param srcoffset Offset of the range in the original file.
+ * @param length Length of the range.
+ * @param cacheoffset Offset of the range reserved in the segment.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::copy_to_cache(state_file_info &fi, const int readfd, off_t srcoffset, const size_t length, off_t cacheoffset)
+{
+    const off_t cacheend = cacheoffset + length;
+    bool eof = false;
+
+    if (reflink_supported)
+    {
+        // A range that is not block aligned (eg. partial last block) falls through to the copy path.
+        if (clone_range(readfd, srcoffset, segmentfd, cacheoffset, length) == 0)
+            return 0;
+        if (is_reflink_unsupported_error(errno))
+            reflink_supported = false;
+    }
+
+    while (!eof && cacheoffset < cacheend && copyfilerange_supported)
+    {
+        const ssize_t res = copy_file_range(readfd, &srcoffset, segmentfd, &cacheoffset, cacheend - cacheoffset, 0);
+        if (res == 0)
+        {
+            eof = true;
+        }
+        else if (res < 0)
+        {
+            if (errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL)
+            {
+                std::cerr << errno << ": copy_file_range to block cache failed " << fi.filepath << "\n";
+                return -1;
+            }
+            copyfilerange_supported = false;
+        }
+    }
+
+    if (!eof && cacheoffset < cacheend && splice_supported)
+    {
+        thread_local int pipefds[2] = {-1, -1};
+        if (pipefds[0] == -1 && pipe(pipefds) == -1)
+        {
+            std::cerr << errno << ": Pipe creation failed\n";
+            return -1;
+        }
+
+        while (!eof && cacheoffset < cacheend && splice_supported)
+        {
+            // Move original file pages into the pipe and then from the pipe into the cache file.
+            ssize_t res = splice(readfd, &srcoffset, pipefds[1], NULL, cacheend - cacheoffset, SPLICE_F_MOVE);
+            if (res == 0)
+            {
+                eof = true;
+            }
+            else if (res < 0)
+            {
+                if (errno != EINVAL && errno != ENOSYS)
+                {
+                    std::cerr << errno << ": splice from original file failed " << fi.filepath << "\n";
+                    return -1;
+                }
+                splice_supported = false;
+            }
+
+            for (ssize_t inpipe = res; inpipe > 0;)
+            {
+                const ssize_t written = splice(pipefds[0], NULL, segmentfd, &cacheoffset, inpipe, SPLICE_F_MOVE);
+                if (written <= 0)
+                {
+                    // Pipe contents are unknown after a failure. Discard the pipe.
+                    std::cerr << errno << ": splice to block cache failed " << fi.filepath << "\n";
+                    close(pipefds[0]);
+                    close(pipefds[1]);
+                    pipefds[0] = pipefds[1] = -1;
+                    return -1;
+                }
+                inpipe -= written;
+            }
+        }
+    }
+
+    // Read/write fallback.
+    thread_local std::vector<char> copybuf;
+    while (!eof && cacheoffset < cacheend)
+    {
+        copybuf.resize(COW_BATCH_SIZE);
+        const ssize_t res = pread(readfd, copybuf.data(), std::min<size_t>(copybuf.size(), cacheend - cacheoffset), srcoffset);
+        if (res < 0)
+        {
+            std::cerr << errno << ": Read failed " << fi.filepath << "\n";
+            return -1;
+        }
+        else if (res == 0)
+        {
+            eof = true;
+        }
+        else if (pwrite(segmentfd, copybuf.data(), res, cacheoffset) != res)
+        {
+            std::cerr << errno << ": Write to block cache failed\n";
+            return -1;
+        }
+        srcoffset += res;
+        cacheoffset += res;
+    }
+
+    // Last block of the file may be partial. We always cache full blocks so we pad the range with zeros.
+    // The segment may already extend beyond the range so we cannot simply extend it with ftruncate.
+    if (cacheoffset < cacheend)
+    {
+        const std::vector<char> zeros(cacheend - cacheoffset, 0);
+        if (pwrite(segmentfd, zeros.data(), zeros.size(), cacheoffset) != (ssize_t)zeros.size())
+        {
+            std::cerr << errno << ": Write to delta segment failed\n";
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes a batch of preserved blocks to the delta segment and their records to the manifest.
+ * @param fi The file info struct pointing to the file being cached.
+ * @param batchdata Buffer containing the preserved blocks back to back. NULL if the blocks have already been
+ *                  copied into the segment.
+ * @param batchblocks Original block ids of the preserved blocks and their segment offsets. If the blocks are in
+ *                    the buffer the offsets are assigned here. This is cleared once the batch is written.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::write_cachebatch(state_file_info &fi, const char *batchdata, std::vector<std::pair<uint32_t, off_t>> &batchblocks)
+{
+    if (batchdata != NULL)
+    {
+        const size_t batchlength = batchblocks.size() * fi.blocksize;
+        const off_t batchoffset = reserve_segment(batchlength);
+        if (batchoffset == -1)
+            return -1;
+
+        if (pwrite(segmentfd, batchdata, batchlength, batchoffset) != (ssize_t)batchlength)
+        {
+            std::cerr << errno << ": Write to delta segment failed\n";
+            return -1;
+        }
+
+        for (size_t idx = 0; idx < batchblocks.size(); idx++)
+            batchblocks[idx].second = batchoffset + idx * fi.blocksize;
+    }
+
+    // Write a block record per block into the manifest before the originals can be overwritten, so an unclean
+    // exit never leaves a preserved block without its record. Block hashes are written as zeros here and
+    // filled in by the background hash pool.
+    off_t recordoffset = 0;
+    {
+        std::lock_guard<std::mutex> lock(delta_mutex);
+        recordoffset = manifestlength;
+        for (const auto &[blockid, cacheoffset] : batchblocks)
+        {
+            if (cacheoffset == ZERO_BLOCK_OFFSET)
+                append_blockrecord(manifestbuf, fi.deltafileid, blockid, 0, 0);
+            else
+                append_blockrecord(manifestbuf, fi.deltafileid, blockid, cacheoffset, fi.blocksize);
+        }
+
+        if (flush_manifest() != 0)
+            return -1;
+    }
+
+    hashpool.enqueue(hash_job{segmentfd, recordoffset, fi.blocksize, config.compression, config.dedup && blockstore.is_open(), batchblocks});
+
+    // Mark the blocks as cached.
+    for (const auto &[blockid, cacheoffset] : batchblocks)
+        fi.cached_blocks.set(blockid);
+    stats.cachedblocks += batchblocks.size();
+
+    batchblocks.clear();
+    return 0;
+}
+
+/**
+ * Writes a batch of preserved blocks whose reads are queued on the io_uring of this thread. The segment write
+ * is chained after the reads and the whole chain is submitted with a single syscall. The manifest records are
+ * then written like any other batch.
+ * @param fi The file info struct pointing to the file being cached.
+ * @param uring Queue holding the reads of the batch. The blocks are read back to back into its buffer.
+ * @param batchblocks Original block ids of the preserved blocks. Their segment offsets are assigned here.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::write_uringbatch(state_file_info &fi, uring_queue &uring, std::vector<std::pair<uint32_t, off_t>> &batchblocks)
+{
+    const size_t batchlength = batchblocks.size() * fi.blocksize;
+    const off_t batchoffset = reserve_segment(batchlength);
+    if (batchoffset == -1)
+    {
+        uring.discard();
+        return -1;
+    }
+
+    uring.queue_write(segmentfd, uring.buffer(), batchlength, batchoffset);
+    if (uring.submit_wait() != 0)
+    {
+        std::cerr << errno << ": io_uring copy to delta segment failed " << fi.filepath << "\n";
+        return -1;
+    }
+
+    for (size_t idx = 0; idx < batchblocks.size(); idx++)
+        batchblocks[idx].second = batchoffset + idx * fi.blocksize;
+
+    return write_cachebatch(fi, NULL, batchblocks);
+}
 
-            boost::filesystem::rename(ctx.deltadir, delta_1);
-            boost::filesystem::create_directories(ctx.deltadir);
+/**
+ * Returns the io_uring queue of the calling thread, setting it up on first use. Each FUSE worker thread
+ * gets its own ring and registered buffer so writers never share a submission queue.
+ * @return NULL if io_uring is not available. Caching falls back to buffered reads and writes then.
+ */
+uring_queue *state_monitor::get_uring()
+{
+    thread_local std::unique_ptr<uring_queue> uring;
+    if (!uring && uring_supported)
+    {
+        uring = std::make_unique<uring_queue>();
+        if (uring->init(URING_QUEUE_DEPTH, COW_BATCH_SIZE) != 0)
+        {
+            std::cerr << errno << ": io_uring setup failed. Falling back to buffered copy.\n";
+            uring_supported = false;
+            uring.reset();
         }
     }
 
-    return;
+    return uring && uring->is_open() ? uring.get() : NULL;
 }
 
-void state_monitor::oncreate(const int fd)
+/**
+ * Initializes the delta manifest record required for caching.
+ * @param fi The state file info struct pointing to the file being cached.
+ * @param ref Reference to the file on disk. Used to resolve the file path if not resolved yet.
+ * @return 0 on succesful initialization. -1 on failure.
+ */
+int state_monitor::prepare_caching(state_file_info &fi, const file_ref &ref)
 {
-    std::lock_guard<std::mutex> lock(monitor_mutex);
+    // If the file already has a manifest record then we take it as caching being already initialized.
+    if (fi.deltafileid != 0)
+        return 0;
 
-    std::string filepath;
-    if (extract_filepath(filepath, fd) == 0)
-        oncreate_filepath(filepath);
+    // Resolve the file path the first time we write a delta entry for this file.
+    if (fi.filepath.empty() && resolve_filepath(fi.filepath, ref) != 0)
+    {
+        std::cerr << errno << ": Path resolution failed for fd " << ref.fd << "\n";
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (open_delta() != 0)
+        return -1;
+
+    // Write the file record. It holds the path of the file relative to the state dir and the length of
+    // the original file which will be helpful when restoring/rolling back.
+    append_filerecord(manifestbuf, lastfileid + 1, fi.original_length, fi.blocksize, get_relpath(fi.filepath, ctx.datadir));
+    if (flush_manifest() != 0)
+        return -1;
+    fi.deltafileid = ++lastfileid;
+
+    return 0;
 }
 
-void state_monitor::onopen(const int inodefd, const int flags)
+/**
+ * Preserves a file whose last link is about to be removed by hard linking its inode into the delta
+ * instead of copying its blocks. Blocks overwritten before the delete are already in the segment and
+ * are restored on top of the inode.
+ * @param fi The state file info struct pointing to the file being deleted.
+ * @param ref Reference to the file being deleted (parent dir fd and name).
+ * @return 0 if the file got linked into the delta. -1 on failure (caller falls back to caching the blocks).
+ */
+int state_monitor::link_deleted(state_file_info &fi, const file_ref &ref)
 {
-    std::lock_guard<std::mutex> lock(monitor_mutex);
+    // Nothing left to preserve from the inode if all the original blocks are already cached.
+    if (fi.cached_blocks.full() && fi.original_length > 0)
+        return -1;
 
-    std::string filepath;
-    if (extract_filepath(filepath, inodefd) == 0)
+    if (prepare_caching(fi, ref) != 0)
+        return -1;
+
+    const std::string linkname = std::string(DELTA_LINKS_DIR).append("/").append(std::to_string(fi.deltafileid));
+    const std::string linkpath = ctx.deltadir + linkname;
+
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (!links_dir_created)
     {
-        state_file_info *fi;
-        if (get_tracked_fileinfo(&fi, filepath) == 0)
+        if (mkdir((ctx.deltadir + DELTA_LINKS_DIR).c_str(), 0755) == -1 && errno != EEXIST)
         {
-            // Check whether fd is open in truncate mode. If so cache the entire file immediately.
-            if (flags & O_TRUNC)
-                cache_blocks(*fi, 0, fi->original_length);
+            std::cerr << errno << ": Creating delta links dir failed\n";
+            return -1;
         }
+        links_dir_created = true;
+    }
+
+    if (linkat(ref.fd, ref.name, AT_FDCWD, linkpath.c_str(), 0) == -1)
+    {
+        // eg. EXDEV if the delta dir is on a different file system.
+        std::cerr << errno << ": Linking deleted file into delta failed " << fi.filepath << "\n";
+        return -1;
     }
+
+    // The deleted file is only reachable through the delta from now on.
+    append_linkrecord(manifestbuf, fi.deltafileid, linkname);
+    if (flush_manifest() != 0)
+        return -1;
+    stats.linkedfiles++;
+
+    return 0;
 }
 
-void state_monitor::onwrite(const int fd, const off_t offset, const size_t length)
+/**
+ * Records that an original file is moving to a new path. Its tracking state and preserved blocks stay with
+ * it and restore moves it back. The file record is written first if the file does not have one yet, so
+ * the record holds the path the file had before the session.
+ * @param fi The state file info struct pointing to the file being renamed.
+ * @param ref Reference to the file at its current path (parent dir fd and name).
+ * @param newfilepath Full physical path the file is moving to. Empty if the file is being deleted.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::write_renamerecord(state_file_info &fi, const file_ref &ref, const std::string &newfilepath)
 {
-    std::lock_guard<std::mutex> lock(monitor_mutex);
-
     std::string filepath;
-    if (get_fd_filepath(filepath, fd) == 0)
+    if (resolve_filepath(filepath, ref) != 0 || prepare_caching(fi, ref) != 0)
+        return -1;
+
+    const std::string relpath = get_relpath(filepath, ctx.datadir);
+    const std::string newrelpath = newfilepath.empty() ? "" : get_relpath(newfilepath, ctx.datadir);
+
+    {
+        std::lock_guard<std::mutex> lock(delta_mutex);
+        append_renamerecord(manifestbuf, fi.deltafileid, relpath, newrelpath);
+        if (flush_manifest() != 0)
+            return -1;
+    }
+
+    if (!newfilepath.empty())
     {
-        state_file_info *fi;
-        if (get_tracked_fileinfo(&fi, filepath) == 0)
-            cache_blocks(*fi, offset, length);
+        fi.filepath = newfilepath;
+        stats.renamedfiles++;
     }
+    return 0;
 }
 
-void state_monitor::onrename(const std::string &oldfilepath, const std::string &newfilepath)
+/**
+ * Opens a read-only fd of the referenced file. We open through the reference rather than the file path
+ * so it works even if the file has been renamed since we resolved its path.
+ * @return The fd. -1 on failure.
+ */
+int state_monitor::open_readfd(const file_ref &ref)
 {
-    std::lock_guard<std::mutex> lock(monitor_mutex);
+    if (ref.name != NULL)
+        return openat(ref.fd, ref.name, O_RDONLY);
 
-    ondelete_filepath(oldfilepath);
-    oncreate_filepath(newfilepath);
+    char proclnk[32];
+    sprintf(proclnk, "/proc/self/fd/%d", ref.fd);
+    return open(proclnk, O_RDONLY);
 }
 
-void state_monitor::ondelete(const std::string &filepath)
+/**
+ * Opens the delta segment and manifest of the session if not open already. Must be called with delta_mutex held.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::open_delta()
 {
-    std::lock_guard<std::mutex> lock(monitor_mutex);
-    ondelete_filepath(filepath);
-}
+    if (segmentfd != -1)
+        return 0;
 
-void state_monitor::ontruncate(const int fd, const off_t newsize)
-{
-    std::lock_guard<std::mutex> lock(monitor_mutex);
+    const std::string segmentfile = ctx.deltadir + DELTA_SEGMENT_FNAME;
+    const std::string manifestfile = ctx.deltadir + DELTA_MANIFEST_FNAME;
 
-    std::string filepath;
-    if (get_fd_filepath(filepath, fd) == 0)
+    // The delta may already contain records from an earlier run in the same checkpoint. We continue
+    // after them with new file ids.
+    delta_manifest existing;
+    if (read_delta_manifest(existing, ctx.deltadir) != 0)
+        return -1;
+    lastfileid = std::max(lastfileid, existing.maxfileid);
+
+    // Blocks and records are written at explicit offsets (copy_file_range does not accept an append mode fd
+    // and hashes are filled into already written records). Hash workers read the blocks back via the segment fd.
+    segmentfd = open(segmentfile.c_str(), O_RDWR | O_CREAT, FILE_PERMS);
+    if (segmentfd == -1)
     {
-        // If truncated size is less than the original, cache the entire file.
-        state_file_info *fi;
-        if (get_tracked_fileinfo(&fi, filepath) == 0 && newsize < fi->original_length)
-            cache_blocks(*fi, 0, fi->original_length);
+        std::cerr << errno << ": Open failed " << segmentfile << "\n";
+        return -1;
     }
-}
 
-void state_monitor::onclose(const int fd)
-{
-    std::lock_guard<std::mutex> lock(monitor_mutex);
+    manifestfd = open(manifestfile.c_str(), O_RDWR | O_CREAT, FILE_PERMS);
+    if (manifestfd == -1)
+    {
+        std::cerr << errno << ": Open failed " << manifestfile << "\n";
+        close(segmentfd);
+        segmentfd = -1;
+        return -1;
+    }
 
-    auto pitr = fdpathmap.find(fd);
-    if (pitr != fdpathmap.end())
+    // Segment bytes past the last recorded block were written before an unclean exit without their records
+    // (or hold compressed copies not yet pointed at). Nothing refers to them so they are reused.
+    segmentlength = ((existing.segmentlength + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
+    manifestlength = lseek(manifestfd, 0, SEEK_END);
+    manifestbuf.clear();
+
+    // Drop any partial record written before an unclean exit so new records follow the last complete one.
+    if (ftruncate(segmentfd, segmentlength) == -1 || ftruncate(manifestfd, std::min(manifestlength, existing.length)) == -1)
     {
-        // Close any block cache/index fds we have opened for this file.
-        auto fitr = fileinfomap.find(pitr->second); // pitr->second is the filepath string.
-        if (fitr != fileinfomap.end())
-            close_cachingfds(fitr->second); // fitr->second is the fileinfo struct.
+        std::cerr << errno << ": Truncate failed " << ctx.deltadir << "\n";
+        close(segmentfd);
+        close(manifestfd);
+        segmentfd = manifestfd = -1;
+        return -1;
+    }
+    manifestlength = std::min(manifestlength, existing.length);
 
-        fdpathmap.erase(pitr);
+    if (manifestlength == 0)
+    {
+        append_manifestheader(manifestbuf);
+        if (flush_manifest() != 0)
+        {
+            close(segmentfd);
+            close(manifestfd);
+            segmentfd = manifestfd = -1;
+            return -1;
+        }
     }
+
+    return 0;
 }
 
 /**
- * Extracts the full physical file path for a given fd.
- * @param filepath String to assign the extracted file path.
- * @param fd The file descriptor to find the filepath.
- * @return 0 on successful file path extraction. -1 on failure.
+ * Opens the block store shared by all checkpoints if dedup is on or an earlier run left blocks there.
+ * Dedup is turned off if the store cannot be opened.
+ * @return 0 on successful execution. -1 on failure.
  */
-int state_monitor::extract_filepath(std::string &filepath, const int fd)
+int state_monitor::open_blockstore()
 {
-    char proclnk[32];
-    sprintf(proclnk, "/proc/self/fd/%d", fd);
+    const std::string storedir = statehistdir + BLOCKSTORE_DIR;
+    if (blockstore.is_open() || (!config.dedup && !boost::filesystem::exists(storedir)))
+        return 0;
 
-    filepath.resize(PATH_MAX);
-    ssize_t len = readlink(proclnk, filepath.data(), PATH_MAX);
-    if (len > 0)
+    // Expired generations still hold their references until they are purged.
+    std::vector<std::string> deltadirs;
+    for (const uint64_t generation : list_generations())
+        deltadirs.push_back(get_generation_deltadir(generation));
+
+    if (blockstore.open(storedir, deltadirs) == -1)
     {
-        filepath.resize(len);
-        return 0;
+        std::cerr << "Block store unavailable. Preserved blocks will not be deduplicated.\n";
+        config.dedup = false;
+        return -1;
     }
-    return -1;
+    return 0;
 }
 
 /**
- * Find the full physical file path for a given fd using the fd map.
- * @param filepath String to assign the extracted file path.
- * @param fd The file descriptor to find the filepath.
- * @return 0 on successful file path extraction. -1 on failure.
+ * Moves the oldest end of the checkpoint window up so it holds no more earlier generations than the
+ * retention allows, and writes out the window. Expired generations are purged in the background.
+ * @return 0 on successful execution. -1 on failure.
  */
-int state_monitor::get_fd_filepath(std::string &filepath, const int fd)
+int state_monitor::apply_retention(checkpoint_window &window)
 {
-    // Return path from the map if found.
-    const auto itr = fdpathmap.find(fd);
-    if (itr != fdpathmap.end())
-    {
-        filepath = itr->second;
-        return 0;
-    }
-
-    // Extract the file path and populate the fd-->filepath map.
-    if (extract_filepath(filepath, fd) == 0)
-    {
-        fdpathmap[fd] = filepath;
-        return 0;
-    }
+    // Rolled back generations leave gaps in the nos. So the live generations are counted rather than the range.
+    const std::vector<uint64_t> live = list_live_generations(window);
+    if (live.size() > config.retention + 1)
+        window.oldest = live[live.size() - 1 - config.retention];
+    if (write_checkpoint_window(window) == -1)
+        return -1;
 
-    return -1;
+    const std::vector<uint64_t> generations = list_generations();
+    if (!generations.empty() && generations.front() < window.oldest)
+        start_purge(window.oldest);
+    return 0;
 }
 
-void state_monitor::oncreate_filepath(const std::string &filepath)
+/**
+ * Has the generations older than the given one purged in the background.
+ */
+void state_monitor::start_purge(const uint64_t oldest)
 {
-    // Check whether we are already tracking this file path.
-    // Only way this could happen is deleting an existing file and creating a new file with same name.
-    if (fileinfomap.count(filepath) == 0)
-    {
-        // Add an entry for the new file in the file info map. This information will be used to ignore
-        // future operations (eg. write/delete) done to this file.
-        state_file_info fi;
-        fi.isnew = true;
-        fi.filepath = filepath;
-        fileinfomap[filepath] = std::move(fi);
-
-        // Add to the list of new files added during this session.
-        write_newfileentry(filepath);
-    }
+    std::lock_guard<std::mutex> lock(purge_mutex);
+    purgelimit = std::max(purgelimit, oldest);
+    if (purging)
+        return;
+
+    if (purgethread.joinable())
+        purgethread.join();
+    purging = true;
+    purgethread = std::thread(&state_monitor::purge_generations, this);
 }
 
-void state_monitor::ondelete_filepath(const std::string &filepath)
+/**
+ * Deletes the delta dirs of the expired generations until there are no more to purge. Their blocks in
+ * the block store lose the references they held.
+ */
+void state_monitor::purge_generations()
 {
-    state_file_info *fi;
-    if (get_tracked_fileinfo(&fi, filepath) == 0)
+    uint64_t purged = 0;
+    while (true)
     {
-        if (fi->isnew)
+        uint64_t limit = 0;
         {
-            // If this is a new file, just remove from existing index entries.
-            // No need to cache the file blocks.
-            remove_newfileentry(fi->filepath);
-            fileinfomap.erase(filepath);
+            std::lock_guard<std::mutex> lock(purge_mutex);
+            if (purgelimit == purged)
+            {
+                purging = false;
+                return;
+            }
+            limit = purgelimit;
         }
-        else
+
+        for (const uint64_t generation : list_generations())
         {
-            // If not a new file, cache the entire file.
-            cache_blocks(*fi, 0, fi->original_length);
+            if (generation >= limit)
+                break;
+
+            const std::string deltadir = get_generation_deltadir(generation);
+            delta_manifest manifest;
+            if (blockstore.is_open() && read_delta_manifest(manifest, deltadir) == -1)
+                manifest.storerefs.clear();
+
+            boost::filesystem::remove_all(deltadir);
+            blockstore.release(manifest.storerefs);
         }
+        purged = limit;
     }
 }
 
 /**
- * Finds the tracked state file information for the given filepath.
- * @param fi Reference pointer to assign the state file info struct.
- * @param filepath Full physical path of the file.
- * @return 0 on successful find. -1 on failure.
+ * Drops all the tracking state of the session so files get tracked afresh against a new checkpoint.
+ * Must be called while file system operations are held off and no inode holds a tracking record.
  */
-int state_monitor::get_tracked_fileinfo(state_file_info **fi, const std::string &filepath)
+void state_monitor::reset_tracking()
 {
-    // Return from filepath-->fileinfo map if found.
-    const auto itr = fileinfomap.find(filepath);
-    if (itr != fileinfomap.end())
+    for (fileinfo_shard &shard : fileinfoshards)
     {
-        *fi = &itr->second;
-        return 0;
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.fileinfomap.clear();
+        shard.spilled.clear();
     }
+    stats.trackedfiles = 0;
+    stats.spilledfiles = 0;
+    spill.clear();
+    fdpool.clear();
+    hashpool.reset();
+
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    newfiles.clear();
+    newfiles_dirty = false;
+    lastfileid = 0;
+}
+
+/**
+ * Reserves space at the end of the delta segment so the caller can write blocks there without holding any lock.
+ * @return Segment offset of the reserved space. -1 on failure.
+ */
+off_t state_monitor::reserve_segment(const size_t length)
+{
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (open_delta() != 0)
+        return -1;
 
-    // Initialize a new state file info struct for the given filepath.
-    state_file_info &fileinfo = fileinfomap[filepath];
+    const off_t offset = segmentlength;
+    segmentlength += length;
+    return offset;
+}
 
-    // We use stat() to find out the length of the file.
-    struct stat stat_buf;
-    if (stat(filepath.c_str(), &stat_buf) != 0)
+/**
+ * Writes the records made in the buffer to the end of the manifest file. The buffer is cleared either way.
+ * Must be called with delta_mutex held.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::flush_manifest()
+{
+    const ssize_t written = pwrite(manifestfd, manifestbuf.data(), manifestbuf.size(), manifestlength);
+    const bool failed = written != (ssize_t)manifestbuf.size();
+    manifestbuf.clear();
+    if (failed)
     {
-        std::cerr << errno << ": Error occured in stat() of " << filepath << "\n";
+        std::cerr << errno << ": Write to delta manifest failed\n";
         return -1;
     }
 
-    fileinfo.original_length = stat_buf.st_size;
-    fileinfo.filepath = filepath;
-    *fi = &fileinfo;
+    manifestlength += written;
     return 0;
 }
 
 /**
- * Caches the specified bytes range of the given file.
- * @param fi The file info struct pointing to the file to be cached.
- * @param offset The start byte position for caching.
- * @param length How many bytes to cache.
+ * Fills the computed hashes of a batch of blocks into their manifest records. The records of the batch are
+ * read back, updated and written in one go. Blocks found to be all zeros are recorded as such. Compressed blocks
+ * are appended to the segment, or all the other blocks are kept in the block store with dedup. The
+ * records are pointed at the stored form and the space of the raw copies is released.
  * @return 0 on successful execution. -1 on failure.
  */
-int state_monitor::cache_blocks(state_file_info &fi, const off_t offset, const size_t length)
+int state_monitor::write_blockhashes(const hash_job &job, const std::vector<hasher::B2H> &hashes, const packed_blocks &packed)
 {
-    // No caching required if this is a new file created during this session.
-    if (fi.isnew)
-        return 0;
-
-    uint32_t original_blockcount = ceil((double)fi.original_length / (double)BLOCK_SIZE);
-
-    // Check whether we have already cached the entire file.
-    if (original_blockcount == fi.cached_blockids.size())
-        return 0;
-
-    // Initialize fds and indexes required for caching.
-    if (prepare_caching(fi) != 0)
-        return -1;
-
-    // Return if incoming write is outside any of the original blocks.
-    if (offset > original_blockcount * BLOCK_SIZE)
-        return 0;
-
-    uint32_t startblock = offset / BLOCK_SIZE;
-    uint32_t endblock = (offset + length) / BLOCK_SIZE;
-
-    // std::cout << "Cache blocks: '" << fi.filepath << "' [" << offset << "," << length << "] " << startblock << "," << endblock << "\n";
-
-    // If this is the first time we are caching this file, write an entry to the touched file index.
-    if (fi.cached_blockids.empty() && write_touchedfileentry(fi.filepath) != 0)
-        return -1;
-
-    for (uint32_t i = startblock; i <= endblock; i++)
+    // With dedup the stored form of every non-zero block is in the packed data and goes to the block store.
+    std::vector<store_block> storeblocks;
+    if (job.dedup)
     {
-        // Skip if we have already cached this block.
-        if (fi.cached_blockids.count(i) > 0)
-            continue;
+        const char *data = packed.data.data();
+        for (size_t idx = 0; idx < job.blocks.size(); idx++)
+        {
+            const uint32_t storedlength = packed.lengths[idx];
+            if (storedlength == 0)
+                continue;
+            storeblocks.push_back(store_block{packed.contenthashes[idx], data, storedlength, storedlength < job.blocksize ? job.codec : block_codec::NONE});
+            data += storedlength;
+        }
+        if (blockstore.add_blocks(storeblocks) == -1)
+            return -1;
+    }
 
-        // Read the block being replaced and send to cache file.
-        char blockbuf[BLOCK_SIZE];
-        off_t blockoffset = BLOCK_SIZE * i;
-        if (pread(fi.readfd, blockbuf, BLOCK_SIZE, BLOCK_SIZE * i) < 0)
+    // Compressed copies are padded to keep the segment block aligned for the raw batches which follow.
+    off_t storedoffset = 0;
+    if (!job.dedup && !packed.data.empty())
+    {
+        const size_t paddedlength = (packed.data.size() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        storedoffset = reserve_segment(paddedlength);
+        if (storedoffset == -1 || pwrite(job.cachefd, packed.data.data(), packed.data.size(), storedoffset) != (ssize_t)packed.data.size())
         {
-            std::cerr << errno << ": Read failed " << fi.filepath << "\n";
+            std::cerr << errno << ": Write to delta segment failed\n";
             return -1;
         }
+    }
 
-        if (write(fi.cachefd, blockbuf, BLOCK_SIZE) < 0)
+    uint64_t storedbytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(delta_mutex);
+        const size_t recordslength = job.blocks.size() * MANIFEST_BLOCKRECORD_SIZE;
+        thread_local std::vector<char> records;
+        records.resize(recordslength);
+        if (pread(manifestfd, records.data(), recordslength, job.recordoffset) != (ssize_t)recordslength)
         {
-            std::cerr << errno << ": Write to block cache failed\n";
+            std::cerr << errno << ": Read from delta manifest failed\n";
             return -1;
         }
 
-        // Append an entry (44 bytes) into the block cache index. We maintain this index to
-        // help random block access for external use cases. We currently do not sort this index here.
-        // Whoever is using the index must sort it if required.
-        // Entry format: [blocknum(4 bytes) | cacheoffset(8 bytes) | blockhash(32 bytes)]
+        auto storeblock = storeblocks.begin();
 
-        char entrybuf[BLOCKINDEX_ENTRY_SIZE];
-        off_t cacheoffset = fi.cached_blockids.size() * BLOCK_SIZE;
-        hasher::B2H hash = hasher::hash(&blockoffset, 8, blockbuf, BLOCK_SIZE);
+        for (size_t idx = 0; idx < hashes.size(); idx++)
+        {
+            // Segment offset, stored length, codec and hash of the block.
+            const uint32_t storedlength = packed.lengths[idx];
+            off_t cacheoffset = job.blocks[idx].second;
+            uint8_t codec = (uint8_t)block_codec::NONE;
+            if (storedlength == 0)
+            {
+                cacheoffset = 0;
+            }
+            else if (job.dedup)
+            {
+                cacheoffset = storeblock->offset;
+                codec = (uint8_t)storeblock->codec | MANIFEST_STOREDBLOCK_FLAG;
+                storeblock++;
+            }
+            else if (storedlength < job.blocksize)
+            {
+                cacheoffset = storedoffset;
+                codec = (uint8_t)job.codec;
+                storedoffset += storedlength;
+            }
+            char *tail = records.data() + idx * MANIFEST_BLOCKRECORD_SIZE + MANIFEST_BLOCKRECORD_OFFSETPOS;
+            memcpy(tail, &cacheoffset, 8);
+            memcpy(tail + 8, &storedlength, 4);
+            tail[12] = (char)codec;
+            memcpy(tail + 13, &hashes[idx], hasher::HASH_SIZE);
+            storedbytes += storedlength;
+        }
 
-        memcpy(entrybuf, &i, 4);
-        memcpy(entrybuf + 4, &cacheoffset, 8);
-        memcpy(entrybuf + 12, hash.data, 32);
-        if (write(fi.indexfd, entrybuf, BLOCKINDEX_ENTRY_SIZE) < 0)
+        if (pwrite(manifestfd, records.data(), recordslength, job.recordoffset) != (ssize_t)recordslength)
         {
-            std::cerr << errno << ": Write to block index failed\n";
+            std::cerr << errno << ": Write to delta manifest failed\n";
             return -1;
         }
+    }
 
-        // Mark the block as cached.
-        fi.cached_blockids.emplace(i);
+    // Release the raw copies of the blocks which are no longer stored raw. Runs contiguous in the segment are
+    // released together. If the file system cannot punch holes the raw copies just stay as unreferenced bytes.
+    const auto is_released = [&](const size_t idx) {
+        return (job.dedup || packed.lengths[idx] < job.blocksize) && job.blocks[idx].second != ZERO_BLOCK_OFFSET;
+    };
+    for (size_t first = 0; first < job.blocks.size();)
+    {
+        size_t last = first;
+        if (is_released(first))
+        {
+            while (last + 1 < job.blocks.size() && is_released(last + 1) &&
+                   job.blocks[last + 1].second == job.blocks[last].second + (off_t)job.blocksize)
+                last++;
+            fallocate(job.cachefd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, job.blocks[first].second, (last - first + 1) * job.blocksize);
+        }
+        first = last + 1;
     }
 
+    for (const uint32_t storedlength : packed.lengths)
+    {
+        if (storedlength == 0)
+            stats.zeroblocks++;
+    }
+    for (const store_block &block : storeblocks)
+    {
+        if (block.duplicate)
+            stats.dedupblocks++;
+    }
+    stats.storeblocks += storeblocks.size();
+    if (job.codec != block_codec::NONE)
+    {
+        stats.compressioninput += (uint64_t)job.blocks.size() * job.blocksize;
+        stats.compressionoutput += storedbytes;
+        stats.compressionnanos += packed.nanos;
+    }
     return 0;
 }
 
 /**
- * Initializes fds and indexes required for caching.
- * @param fi The state file info struct pointing to the file being cached.
- * @return 0 on succesful initialization. -1 on failure.
+ * Inserts a file into the list of new files created during this session.
+ * This list is used in deleting new files during restore. The change is appended to the new files log
+ * right away and the whole list is written to the new files index when the delta is closed.
+ * @return 0 on successful execution. -1 on failure.
  */
-int state_monitor::prepare_caching(state_file_info &fi)
+int state_monitor::write_newfileentry(std::string_view filepath)
 {
-    // If readfd is greater than 0 then we take it as caching being already initialized.
-    if (fi.readfd > 0)
-        return 0;
-
-    // Open up the file using a read-only fd. This fd will be used to fetch blocks to be cached.
-    fi.readfd = open(fi.filepath.c_str(), O_RDONLY);
-    if (fi.readfd < 0)
-    {
-        std::cerr << errno << ": Open failed " << fi.filepath << "\n";
+    const std::string_view relpath = filepath.substr(ctx.datadir.length());
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (write_newfileslog(NEWFILES_CREATE_RECORD, relpath) != 0)
         return -1;
-    }
-
-    // Get the path of the file relative to the state dir. We maintain this same reative path for the
-    // corresponding cache and index files in the cache dir.
-    std::string relpath = get_relpath(fi.filepath, ctx.datadir);
-
-    std::string tmppath;
-    tmppath.reserve(ctx.deltadir.length() + relpath.length() + BLOCKCACHE_EXT_LEN);
-    tmppath.append(ctx.deltadir).append(relpath).append(BLOCKCACHE_EXT);
-
-    // Create directory tree if not exist so we are able to create the cache and index files.
-    boost::filesystem::path cachesubdir = boost::filesystem::path(tmppath).parent_path();
-    if (created_cachesubdirs.count(cachesubdir.string()) == 0)
-    {
-        boost::filesystem::create_directories(cachesubdir);
-        created_cachesubdirs.emplace(cachesubdir.string());
-    }
+    newfiles.emplace(relpath);
+    newfiles_dirty = true;
+    return 0;
+}
 
-    // Create and open the block cache file.
-    fi.cachefd = open(tmppath.c_str(), O_WRONLY | O_APPEND | O_CREAT, FILE_PERMS);
-    if (fi.cachefd <= 0)
-    {
-        std::cerr << errno << ": Open failed " << tmppath << "\n";
+/**
+ * Removes the given filepath from the list of new files.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::remove_newfileentry(std::string_view filepath)
+{
+    const std::string_view relpath = filepath.substr(ctx.datadir.length());
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    if (write_newfileslog(NEWFILES_REMOVE_RECORD, relpath) != 0)
         return -1;
-    }
+    newfiles.erase(std::string(relpath));
+    newfiles_dirty = true;
+    return 0;
+}
 
-    // Create and open the block index file.
-    tmppath.replace(tmppath.length() - BLOCKCACHE_EXT_LEN, BLOCKINDEX_EXT_LEN, BLOCKINDEX_EXT);
-    fi.indexfd = open(tmppath.c_str(), O_WRONLY | O_APPEND | O_CREAT, FILE_PERMS);
-    if (fi.indexfd <= 0)
+/**
+ * Appends a record to the end of the new files log. Must be called with delta_mutex held.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_monitor::write_newfileslog(const char type, std::string_view relpath)
+{
+    const std::string logfile = ctx.deltadir + LOG_NEWFILES;
+    if (newfileslogfd == -1)
     {
-        std::cerr << errno << ": Open failed " << tmppath << "\n";
-        return -1;
+        newfileslogfd = open(logfile.c_str(), O_WRONLY | O_APPEND | O_CREAT, FILE_PERMS);
+        if (newfileslogfd == -1)
+        {
+            std::cerr << errno << ": Open failed " << logfile << "\n";
+            return -1;
+        }
     }
 
-    // Write first entry (8 bytes) to the index file. First entry is the length of the original file.
-    // This will be helpful when restoring/rolling back a file.
-    if (write(fi.indexfd, &fi.original_length, 8) == -1)
+    thread_local std::vector<char> record;
+    record.clear();
+    append_newfilerecord(record, type, relpath);
+    if (write(newfileslogfd, record.data(), record.size()) != (ssize_t)record.size())
     {
-        std::cerr << errno << ": Error writing to index file " << tmppath << "\n";
+        std::cerr << errno << ": Write failed " << logfile << "\n";
         return -1;
     }
-
     return 0;
 }
 
 /**
- * Closes any open caching fds for a given file.
+ * Loads the new files of an earlier run in the same checkpoint so we continue adding to them. If the earlier
+ * run did not close the delta, the records left in its new files log are folded into the index right away.
+ */
+void state_monitor::read_newfileindex()
+{
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    read_newfiles(newfiles, ctx.deltadir);
+    newfiles_dirty = boost::filesystem::exists(ctx.deltadir + LOG_NEWFILES);
+    write_newfileindex();
+}
+
+/**
+ * Reloads the tracking state of the files touched by an earlier run in the same checkpoint from the delta.
+ * Without this, blocks preserved by the earlier run would get preserved again with their already modified
+ * contents. The tracked files are looked up in parallel since each one needs a stat of its current path.
+ * @return 0 on successful execution. -1 on failure.
  */
-void state_monitor::close_cachingfds(state_file_info &fi)
+int state_monitor::resume_session()
 {
-    if (fi.readfd > 0)
-        close(fi.readfd);
+    delta_manifest manifest;
+    if (read_delta_manifest(manifest, ctx.deltadir) != 0)
+        return -1;
+
+    for (const std::string &relpath : newfiles)
+        resume_newfile(relpath);
 
-    if (fi.cachefd > 0)
-        close(fi.cachefd);
+    if (manifest.files.empty())
+        return 0;
 
-    if (fi.indexfd > 0)
-        close(fi.indexfd);
+    const size_t threadcount = std::min(RESUME_THREAD_COUNT, manifest.files.size() / RESUME_FILES_PER_THREAD + 1);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < threadcount; t++)
+    {
+        threads.emplace_back([&, t]() {
+            for (size_t pos = t; pos < manifest.files.size(); pos += threadcount)
+                resume_file(manifest.files[pos]);
+        });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
 
-    fi.readfd = 0;
-    fi.cachefd = 0;
-    fi.indexfd = 0;
+    // Records of the resumed files continue in the existing delta. So it needs to be open before any of them.
+    std::lock_guard<std::mutex> lock(delta_mutex);
+    return open_delta();
 }
 
 /**
- * Inserts a file into the modified files list of this session.
- * This index is used to restore modified files during restore.
+ * Tracks a file touched by an earlier run with its original length and preserved blocks.
+ * Deleted files are not tracked since nothing can reach them anymore.
  */
-int state_monitor::write_touchedfileentry(std::string_view filepath)
+void state_monitor::resume_file(const delta_file &file)
 {
-    if (touchedfileindexfd <= 0)
+    struct stat stat_buf;
+    const std::string filepath = ctx.datadir + file.currentpath;
+    if (file.deleted || stat(filepath.c_str(), &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+        return;
+
+    std::shared_ptr<state_file_info> fi = std::make_shared<state_file_info>();
+    fi->original_length = file.original_length;
+    fi->sparse = stat_buf.st_blocks * 512 < stat_buf.st_size;
+    fi->blocksize = file.blocksize;
+    fi->filepath = filepath;
+    fi->deltafileid = file.fileid;
+    fi->trackingid = ++lasttrackingid;
+    fi->cached_blocks.reset(ceil((double)fi->original_length / (double)fi->blocksize));
+    for (const auto &[blockno, block] : file.blocks)
     {
-        std::string indexfile = ctx.deltadir + "/idxtouched.idx";
-        touchedfileindexfd = open(indexfile.c_str(), O_WRONLY | O_APPEND | O_CREAT, FILE_PERMS);
-        if (touchedfileindexfd <= 0)
-        {
-            std::cerr << errno << ": Open failed " << indexfile << "\n";
-            return -1;
-        }
+        if (blockno < fi->cached_blocks.size())
+            fi->cached_blocks.set(blockno);
     }
 
-    // Write the relative file path line to the index.
-    filepath = filepath.substr(ctx.datadir.length(), filepath.length() - ctx.datadir.length());
-    write(touchedfileindexfd, filepath.data(), filepath.length());
-    write(touchedfileindexfd, "\n", 1);
-    return 0;
+    const SrcId id(stat_buf.st_ino, stat_buf.st_dev);
+    fileinfo_shard &shard = get_fileinfo_shard(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.fileinfomap.try_emplace(id, fi).second)
+    {
+        stats.trackedfiles++;
+        stats.resumedfiles++;
+    }
 }
 
 /**
- * Inserts a file into the list of new files created during this session.
- * This index is used in deleting new files during restore.
+ * Tracks a file created by an earlier run as a new file so it does not get preserved.
  */
-int state_monitor::write_newfileentry(std::string_view filepath)
+void state_monitor::resume_newfile(const std::string &relpath)
 {
-    std::string indexfile = ctx.deltadir + "/idxnew.idx";
-    int fd = open(indexfile.c_str(), O_WRONLY | O_APPEND | O_CREAT, FILE_PERMS);
-    if (fd <= 0)
+    struct stat stat_buf;
+    const std::string filepath = ctx.datadir + relpath;
+    if (stat(filepath.c_str(), &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+        return;
+
+    std::shared_ptr<state_file_info> fi = std::make_shared<state_file_info>();
+    fi->isnew = true;
+    fi->filepath = filepath;
+    fi->trackingid = ++lasttrackingid;
+
+    const SrcId id(stat_buf.st_ino, stat_buf.st_dev);
+    fileinfo_shard &shard = get_fileinfo_shard(id);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.fileinfomap.try_emplace(id, fi).second)
     {
-        std::cerr << errno << ": Open failed " << indexfile << "\n";
-        return -1;
+        stats.trackedfiles++;
+        stats.resumedfiles++;
     }
-
-    // Write the relative file path line to the index.
-    filepath = filepath.substr(ctx.datadir.length(), filepath.length() - ctx.datadir.length());
-    write(fd, filepath.data(), filepath.length());
-    write(fd, "\n", 1);
-    close(fd);
-    return 0;
 }
 
 /**
- * Scans and removes the given filepath from the new files index.
+ * Replaces the new files index with the current list of new files and drops the new files log which
+ * it supersedes. Must be called with delta_mutex held.
+ * @return 0 on successful execution. -1 on failure.
  */
-void state_monitor::remove_newfileentry(std::string_view filepath)
+int state_monitor::write_newfileindex()
 {
-    filepath = filepath.substr(ctx.datadir.length(), filepath.length() - ctx.datadir.length());
-
-    // We create a copy of the new file index and transfer lines from first file
-    // to the second file except the line matching the given filepath.
-
-    std::string indexfile = ctx.deltadir + "/idxnew.idx";
-    std::string indexfile_tmp = ctx.deltadir + "/idxnew.idx.tmp";
-
-    std::ifstream infile(indexfile);
-    std::ofstream outfile(indexfile_tmp);
+    if (!newfiles_dirty)
+        return 0;
 
-    bool linestransferred = false;
-    for (std::string line; std::getline(infile, line);)
+    const std::string indexfile = ctx.deltadir + IDX_NEWFILES;
+    if (newfiles.empty())
+    {
+        std::remove(indexfile.c_str());
+    }
+    else
     {
-        if (line != filepath) // Skip the file being removed.
+        // Write the index to a temp file and swap it in so we never leave a partial index behind.
+        const std::string indexfile_tmp = indexfile + ".tmp";
+        std::ofstream outfile(indexfile_tmp);
+        for (const std::string &relpath : newfiles)
+            outfile << relpath << "\n";
+        outfile.close();
+
+        if (outfile.fail() || std::rename(indexfile_tmp.c_str(), indexfile.c_str()) == -1)
         {
-            outfile << line << "\n";
-            linestransferred = true;
+            std::cerr << errno << ": Write failed " << indexfile << "\n";
+            return -1;
         }
     }
 
-    infile.close();
-    outfile.close();
-
-    // Remove the old index.
-    std::remove(indexfile.c_str());
+    // Replaying the log on top of the new index gives the same list. So a failure to remove it does no harm.
+    if (newfileslogfd != -1)
+        close(newfileslogfd);
+    newfileslogfd = -1;
+    std::remove((ctx.deltadir + LOG_NEWFILES).c_str());
 
-    // If no lines transferred, delete the temp file as well.
-    if (linestransferred)
-        std::rename(indexfile_tmp.c_str(), indexfile.c_str());
-    else
-        std::remove(indexfile_tmp.c_str());
+    newfiles_dirty = false;
+    return 0;
 }
 
 } // namespace statefs
\ No newline at end of file
@@ -5,73 +5,312 @@
 #include <sys/types.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <ostream>
+#include <functional>
 #include <boost/filesystem.hpp>
 #include "../state_common.hpp"
+#include "../delta_manifest.hpp"
+#include "block_bitmap.hpp"
+#include "hash_pool.hpp"
+#include "fd_pool.hpp"
+#include "tracking_spill.hpp"
+#include "uring_queue.hpp"
+#include "block_store.hpp"
+#include "op_gate.hpp"
+
+// Uniquely identifies a file in the source directory tree. This could
+// be simplified to just ino_t since we require the source directory
+// not to contain any mountpoints. This hasn't been done yet in case
+// we need to reconsider this constraint (but relaxing this would have
+// the drawback that we can no longer re-use inode numbers, and thus
+// readdir() would need to do a full lookup() in order to report the
+// right inode number).
+typedef std::pair<ino_t, dev_t> SrcId;
+
+// Define a hash function for SrcId
+namespace std
+{
+template <>
+struct hash<SrcId>
+{
+    size_t operator()(const SrcId &id) const
+    {
+        return hash<ino_t>{}(id.first) ^ hash<dev_t>{}(id.second);
+    }
+};
+} // namespace std
 
 namespace statefs
 {
 
+// No. of lock stripes used for the file tracking map. Files hashing into different stripes
+// can be looked up and tracked in parallel.
+constexpr size_t MONITOR_SHARD_COUNT = 32;
+
+// Max. no. of bytes of blocks preserved with a single block cache write.
+constexpr size_t COW_BATCH_SIZE = 1024 * 1024;
+
+// No. of background threads computing the hashes of preserved blocks.
+constexpr size_t HASH_WORKER_COUNT = 2;
+
+// Max. no. of operations chained on the io_uring of a thread. A batch needs a read per run of blocks and one write.
+constexpr unsigned URING_QUEUE_DEPTH = 512;
+
+// Approx. memory held by an in-memory tracking record apart from its block bitmap (the record, its path,
+// the map node and the shared pointer control block). Used to keep within the tracking memory budget.
+constexpr size_t TRACKED_RECORD_SIZE = 256;
+
+// Max. no. of threads used to reload the tracking state of an earlier run, and the min. no. of files per thread.
+constexpr size_t RESUME_THREAD_COUNT = 4;
+constexpr size_t RESUME_FILES_PER_THREAD = 256;
+
 // Holds information about an original file in state that we are tracking.
 struct state_file_info
 {
-    bool isnew;
-    off_t original_length;
-    std::unordered_set<uint32_t> cached_blockids;
+    // Mutex to serialize caching operations on this file. Caching for different files
+    // runs in parallel.
+    std::mutex m;
+
+    bool isnew = false;
+    off_t original_length = 0;
+    uint32_t blocksize = BLOCK_SIZE; // Copy-on-write block size of the file.
+    bool sparse = false; // Whether the file had holes when tracking started. Holes are preserved without copying.
+    block_bitmap cached_blocks;
+
+    // Full physical path of the file. This is resolved lazily when we first write a delta entry for the file.
     std::string filepath;
-    int readfd;
-    int cachefd;
-    int indexfd;
+
+    // Id of the file record in the delta manifest. 0 until the first block of the file is preserved.
+    uint32_t deltafileid = 0;
+
+    // Unique id of this tracking record. Its read fd is pooled under this id.
+    uint64_t trackingid = 0;
+};
+
+// Per-inode slot of the file system holding the tracking record attached to the inode. It also
+// publishes the offset below which writes to the inode may still need preservation, so that the
+// other writes can skip the monitor without taking any locks.
+struct fileinfo_slot
+{
+    std::shared_ptr<state_file_info> fileinfo;
+
+    // Writes at or beyond this offset need no preservation. -1 until the tracking record gets attached.
+    // 0 once the file is new or fully preserved. Otherwise the original length of the file.
+    std::atomic<off_t> preservelimit{-1};
+};
+
+// Locates a file on disk so its path can be resolved lazily. Either an fd of the file
+// itself (name is null) or a parent directory fd and the entry name under it.
+struct file_ref
+{
+    int fd;
+    const char *name;
+};
+
+// Modes of copying original blocks into the block cache.
+enum class copy_mode
+{
+    BUFFERED, // Read into a userspace buffer and write to the block cache.
+    KERNEL,   // Copy inside the kernel with copy_file_range/splice.
+    URING     // Chain the reads and the block cache write on a per-thread io_uring. Falls back to BUFFERED.
+};
+
+// Runtime configuration of the state monitor.
+struct monitor_config
+{
+    copy_mode copymode = copy_mode::BUFFERED; // Kernel and io_uring copy are opt-in with --copy=kernel|uring.
+
+    // Whether to preserve deleted files by hard linking them into the delta instead of copying their blocks.
+    bool linkdeleted = true;
+
+    // Max. no. of read fds of tracked files kept open when not in use.
+    size_t fdpoolsize = 256;
+
+    // Whether to share extents with the block cache (and back on restore) when the file system supports it.
+    bool reflink = true;
+
+    // Copy-on-write block size of all files. 0 picks the block size of each file by its original length.
+    uint32_t blocksize = 0;
+
+    // Whether to continue the session of the previous run instead of starting a new checkpoint.
+    bool resume = false;
+
+    // Memory budget in bytes for tracking records. Cold records beyond it are spilled to disk. 0 for no limit.
+    size_t trackmemory = 0;
+
+    // Codec the preserved blocks are compressed with in the background. Blocks stay raw with NONE.
+    block_codec compression = block_codec::NONE;
+
+    // No. of earlier checkpoints whose deltas are retained.
+    uint32_t retention = MAX_CHECKPOINTS + 1;
+
+    // Whether to keep preserved blocks in the block store shared by all checkpoints, storing identical blocks once.
+    bool dedup = false;
+};
+
+// Counters describing the state monitor activity during the session.
+struct monitor_stats
+{
+    std::atomic<int64_t> trackedfiles{0};
+    std::atomic<uint64_t> cachedblocks{0};
+    std::atomic<uint64_t> linkedfiles{0};
+    std::atomic<uint64_t> renamedfiles{0};
+    std::atomic<uint64_t> resumedfiles{0};
+    std::atomic<int64_t> spilledfiles{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> fastpathwrites{0};
+    std::atomic<uint64_t> zeroblocks{0};        // Preserved blocks which were all zeros and take no space.
+    std::atomic<uint64_t> compressioninput{0};  // Bytes of preserved blocks passed through compression.
+    std::atomic<uint64_t> compressionoutput{0}; // Bytes they are stored with.
+    std::atomic<uint64_t> compressionnanos{0};
+    std::atomic<uint64_t> storeblocks{0}; // Preserved blocks referencing the block store.
+    std::atomic<uint64_t> dedupblocks{0}; // Of those, the ones which were already in the store.
+};
+
+// One lock stripe of the file id-->fileinfo map.
+struct fileinfo_shard
+{
+    std::mutex mutex;
+    std::unordered_map<SrcId, std::shared_ptr<state_file_info>> fileinfomap;
+    std::unordered_map<SrcId, off_t> spilled; // File id-->offset of the tracking record evicted to the spill file.
 };
 
 // Invoked by fuse file system for relevent file system calls.
+// File system inodes hold a reference to the tracking record of their file (fileinfo slot)
+// so steady-state operations do not need any path or map lookups.
 class state_monitor
 {
 private:
-    // Map of fd-->filepath
-    std::unordered_map<int, std::string> fdpathmap;
+    // Map of file id-->fileinfo
+    fileinfo_shard fileinfoshards[MONITOR_SHARD_COUNT];
+
+    // Mutex to synchronize access to the session-wide delta segment, manifest and indexes.
+    // Must be acquired *after* any state_file_info.m locks.
+    std::mutex delta_mutex;
+
+    // Preserved blocks of all files are appended to a single segment file and described by records
+    // in a single manifest. These are opened with the first preserved block.
+    int segmentfd = -1;
+    int manifestfd = -1;
+    off_t segmentlength = 0;
+    off_t manifestlength = 0;
+    std::vector<char> manifestbuf;   // Records being made. Written to the manifest file right away.
+    uint32_t lastfileid = 0;
+    bool links_dir_created = false;
+
+    // Relative paths of the files created during the session. Guarded by delta_mutex. Creates and deletes
+    // update this set and append a record to the new files log. The set replaces the new files index and
+    // the log is dropped when the delta is closed.
+    std::unordered_set<std::string> newfiles;
+    bool newfiles_dirty = false;
+    int newfileslogfd = -1;
 
-    // Map of filepath-->fileinfo
-    std::unordered_map<std::string, state_file_info> fileinfomap;
+    monitor_stats stats;
 
-    // Complete list of modified files during the session.
-    std::unordered_set<std::string> touchedfiles;
+    // Whether kernel copy mechanisms work between the state and delta dirs. Cleared on first failure.
+    std::atomic<bool> reflink_supported{false};
+    std::atomic<bool> copyfilerange_supported{true};
+    std::atomic<bool> splice_supported{true};
+    std::atomic<bool> uring_supported{true};
 
-    // List of new cache sub directories created during the session.
-    std::unordered_set<std::string> created_cachesubdirs;
+    // Read fds of the files being preserved. Shared across all files so the no. of open fds stays bounded.
+    fd_pool fdpool;
+    std::atomic<uint64_t> lasttrackingid{0};
 
-    // Mutex to synchronize parallel file system calls into our custom state tracking logic.
-    std::mutex monitor_mutex;
+    // Cold tracking records evicted from memory. Only one thread trims at a time, starting from the
+    // shard after the one the last trim stopped at.
+    tracking_spill spill;
+    std::mutex trim_mutex;
+    size_t trimcursor = 0;
 
-    // Holds the fd used to write into modified files index. This will be kept open for the entire
-    // life of the state monitor.
-    int touchedfileindexfd = 0;
+    // Distinct preserved blocks shared by the deltas of all checkpoints. Opened if dedup is on or an earlier
+    // run left blocks there.
+    block_store blockstore;
+
+    // Deletes the deltas of expired checkpoint generations in the background. A purge in progress picks up
+    // the generations which expire while it runs.
+    std::thread purgethread;
+    std::mutex purge_mutex;
+    uint64_t purgelimit = 0; // Generations older than this are to be purged.
+    bool purging = false;
+
+    // Background workers filling in the hashes of preserved blocks.
+    hash_pool hashpool{HASH_WORKER_COUNT, [this](const hash_job &job, const std::vector<hasher::B2H> &hashes, const packed_blocks &packed) {
+                           return write_blockhashes(job, hashes, packed);
+                       }};
+
+    fileinfo_shard &get_fileinfo_shard(const SrcId &id);
 
     int extract_filepath(std::string &filepath, const int fd);
-    int get_fd_filepath(std::string &filepath, const int fd);
-    void oncreate_filepath(const std::string &filepath);
-    void ondelete_filepath(const std::string &filepath);
-    int get_tracked_fileinfo(state_file_info **fileinfo, const std::string &filepath);
-
-    int cache_blocks(state_file_info &fi, const off_t offset, const size_t length);
-    int prepare_caching(state_file_info &fi);
-    void close_cachingfds(state_file_info &fi);
-    int write_touchedfileentry(std::string_view filepath);
+    int resolve_filepath(std::string &filepath, const file_ref &ref);
+    int get_tracked_fileinfo(std::shared_ptr<state_file_info> &fi, const struct stat &stat_buf);
+    int get_attached_fileinfo(std::shared_ptr<state_file_info> &fi, fileinfo_slot &slot, const int inodefd);
+    void update_preservelimit(fileinfo_slot &slot, state_file_info &fi);
+    void untrack_fileinfo(const std::shared_ptr<state_file_info> &fi, const struct stat &stat_buf);
+    int64_t tracking_memory();
+    void trim_tracking();
+    void freeze_fileinfo(std::vector<char> &record, const state_file_info &fi);
+    int thaw_fileinfo(std::shared_ptr<state_file_info> &fi, const std::vector<char> &record);
+
+    int cache_blocks(state_file_info &fi, const file_ref &ref, const off_t offset, const size_t length);
+    template <size_t BS>
+    int cache_blockruns(state_file_info &fi, const int readfd, const off_t offset, const size_t length);
+    int copy_to_cache(state_file_info &fi, const int readfd, off_t srcoffset, const size_t length, off_t cacheoffset);
+    int write_cachebatch(state_file_info &fi, const char *batchdata, std::vector<std::pair<uint32_t, off_t>> &batchblocks);
+    int write_uringbatch(state_file_info &fi, uring_queue &uring, std::vector<std::pair<uint32_t, off_t>> &batchblocks);
+    uring_queue *get_uring();
+    int prepare_caching(state_file_info &fi, const file_ref &ref);
+    int open_readfd(const file_ref &ref);
+    int link_deleted(state_file_info &fi, const file_ref &ref);
+    int write_renamerecord(state_file_info &fi, const file_ref &ref, const std::string &newfilepath);
+    int open_delta();
+    int open_blockstore();
+    int apply_retention(checkpoint_window &window);
+    void start_purge(const uint64_t oldest);
+    void purge_generations();
+    void reset_tracking();
+    off_t reserve_segment(const size_t length);
+    int flush_manifest();
+    int write_blockhashes(const hash_job &job, const std::vector<hasher::B2H> &hashes, const packed_blocks &packed);
     int write_newfileentry(std::string_view filepath);
-    void remove_newfileentry(std::string_view filepath);
+    int remove_newfileentry(std::string_view filepath);
+    int write_newfileslog(const char type, std::string_view relpath);
+    void read_newfileindex();
+    int resume_session();
+    void resume_file(const delta_file &file);
+    void resume_newfile(const std::string &relpath);
+    int write_newfileindex();
+    void fail_rollback();
 
 public:
     statedir_context ctx;
-    void create_checkpoint();
-    void oncreate(const int fd);
-    void onopen(const int inodefd, const int flags);
-    void onwrite(const int fd, const off_t offset, const size_t length);
-    void onrename(const std::string &oldfilepath, const std::string &newfilepath);
-    void ondelete(const std::string &filepath);
-    void ontruncate(const int fd, const off_t newsize);
-    void onclose(const int fd);
+    monitor_config config;
+
+    // File system operations which reach the hooks below pass this gate (along with the changes they
+    // make), so a checkpoint can be cut in between operations while mounted.
+    op_gate gate;
+
+    ~state_monitor();
+    void init(const bool reflink_capable);
+    int create_checkpoint();
+    int cut_checkpoint(uint64_t &generation, const std::function<void()> &detach_slots);
+    int rollback_checkpoint(std::vector<std::string> &touchedpaths, const std::function<void()> &detach_slots);
+    int oncreate(fileinfo_slot &slot, const int fd);
+    void onopen(fileinfo_slot &slot, const int inodefd, const int flags);
+    void onwrite(fileinfo_slot &slot, const int inodefd, const off_t offset, const size_t length);
+    int onrename(const int parentfd, const char *name, const int newparentfd, const char *newname);
+    int ondelete(const int parentfd, const char *name);
+    void ontruncate(fileinfo_slot &slot, const int inodefd, const off_t newsize);
+    void onfallocate(fileinfo_slot &slot, const int inodefd, const int mode, const off_t offset, const off_t length);
+    int close_delta();
+    void print_stats(std::ostream &out);
 };
 
 } // namespace statefs
 
-#endif
\ No newline at end of file
+#endif
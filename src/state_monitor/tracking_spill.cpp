@@ -0,0 +1,152 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../state_common.hpp"
+#include "tracking_spill.hpp"
+
+namespace statefs
+{
+
+tracking_spill::~tracking_spill()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+/**
+ * Creates the spill file in the given dir. Does nothing if it is already open.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int tracking_spill::open(const std::string &dir)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd != -1)
+        return 0;
+
+    fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR, FILE_PERMS);
+    if (fd == -1)
+    {
+        // File system does not support O_TMPFILE. Create a named file and unlink it right away.
+        const std::string spillfile = dir + "/tracking.spill";
+        fd = ::open(spillfile.c_str(), O_CREAT | O_TRUNC | O_RDWR, FILE_PERMS);
+        if (fd == -1)
+        {
+            std::cerr << errno << ": Open failed " << spillfile << "\n";
+            return -1;
+        }
+        unlink(spillfile.c_str());
+    }
+
+    length = 0;
+    return 0;
+}
+
+/**
+ * Returns the size class of the slot holding a record of the given length. A slot of class c is 2^c bytes.
+ */
+uint32_t tracking_spill::get_slotclass(const uint32_t recordlen)
+{
+    const uint64_t slotlen = 4 + (uint64_t)recordlen;
+    return std::max<uint32_t>(SPILL_MIN_SLOT_SHIFT, 64 - __builtin_clzll(slotlen - 1));
+}
+
+/**
+ * Writes a record into a free slot of its size class, or into a new slot at the end of the spill file.
+ * @return Offset of the record to read it back with. -1 on failure.
+ */
+off_t tracking_spill::write(const std::vector<char> &record)
+{
+    const uint32_t recordlen = record.size();
+    const uint32_t slotclass = get_slotclass(recordlen);
+    off_t offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (slotclass < freeslots.size() && !freeslots[slotclass].empty())
+        {
+            offset = freeslots[slotclass].back();
+            freeslots[slotclass].pop_back();
+        }
+        else
+        {
+            offset = length;
+            length += (off_t)1 << slotclass;
+        }
+        livebytes += (off_t)1 << slotclass;
+    }
+
+    std::vector<char> buf(4 + recordlen);
+    memcpy(buf.data(), &recordlen, 4);
+    memcpy(buf.data() + 4, record.data(), recordlen);
+    if (pwrite(fd, buf.data(), buf.size(), offset) != (ssize_t)buf.size())
+    {
+        std::cerr << errno << ": Write to tracking spill failed\n";
+        free_slot(offset, slotclass);
+        return -1;
+    }
+
+    return offset;
+}
+
+/**
+ * Reads back the record at the given offset.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int tracking_spill::read(std::vector<char> &record, const off_t offset)
+{
+    uint32_t recordlen = 0;
+    if (pread(fd, &recordlen, 4, offset) != 4)
+    {
+        std::cerr << errno << ": Read from tracking spill failed\n";
+        return -1;
+    }
+
+    record.resize(recordlen);
+    if (pread(fd, record.data(), recordlen, offset + 4) != recordlen)
+    {
+        std::cerr << errno << ": Read from tracking spill failed\n";
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the slot of the record at the given offset for reuse. The record must not be read after this.
+ */
+void tracking_spill::release(const off_t offset)
+{
+    // The slot size follows from the record length at the start of the slot.
+    uint32_t recordlen = 0;
+    if (pread(fd, &recordlen, 4, offset) != 4)
+    {
+        std::cerr << errno << ": Read from tracking spill failed\n";
+        return;
+    }
+    free_slot(offset, get_slotclass(recordlen));
+}
+
+void tracking_spill::free_slot(const off_t offset, const uint32_t slotclass)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (freeslots.size() <= slotclass)
+        freeslots.resize(slotclass + 1);
+    freeslots[slotclass].push_back(offset);
+    livebytes -= (off_t)1 << slotclass;
+}
+
+/**
+ * Drops all the records in the spill file.
+ */
+void tracking_spill::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd != -1 && ftruncate(fd, 0) == -1)
+        std::cerr << errno << ": Truncate of tracking spill failed\n";
+    length = 0;
+    livebytes = 0;
+    freeslots.clear();
+}
+
+} // namespace statefs
@@ -0,0 +1,45 @@
+#ifndef _STATEFS_TRACKING_SPILL_
+#define _STATEFS_TRACKING_SPILL_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <mutex>
+
+namespace statefs
+{
+
+// Size of the smallest spill slot as a power of two (64 bytes).
+constexpr uint32_t SPILL_MIN_SLOT_SHIFT = 6;
+
+// Store of frozen tracking records which were evicted from memory to keep the state monitor within its
+// memory budget. Records are kept in an unlinked temp file so nothing is left behind after exit. Each record
+// takes a slot of a power of two size. Slots of records which are thawed or dropped are reused by later
+// records of the same size class, so the file does not keep growing while records move in and out of memory.
+class tracking_spill
+{
+private:
+    int fd = -1;
+    off_t length = 0;                           // Length of the spill file.
+    off_t livebytes = 0;                        // Bytes in the slots of live records.
+    std::vector<std::vector<off_t>> freeslots;  // Offsets of free slots by size class.
+    std::mutex mutex;
+
+    static uint32_t get_slotclass(const uint32_t recordlen);
+    void free_slot(const off_t offset, const uint32_t slotclass);
+
+public:
+    ~tracking_spill();
+    int open(const std::string &dir);
+    off_t write(const std::vector<char> &record);
+    int read(std::vector<char> &record, const off_t offset);
+    void release(const off_t offset);
+    void clear();
+    off_t size() const { return length; }
+    off_t live_size() const { return livebytes; }
+};
+
+} // namespace statefs
+
+#endif
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "uring_queue.hpp"
+
+namespace statefs
+{
+
+uring_queue::~uring_queue()
+{
+    if (sqes != NULL)
+        munmap(sqes, entries * sizeof(io_uring_sqe));
+    if (cqring != NULL && cqring != sqring)
+        munmap(cqring, cqringsize);
+    if (sqring != NULL)
+        munmap(sqring, sqringsize);
+    if (ringfd != -1)
+        close(ringfd);
+    if (buf != NULL)
+        munmap(buf, buflen);
+    delete[] expected;
+}
+
+/**
+ * Sets up the ring and registers its buffer with the kernel.
+ * @param depth Max. no. of operations in a chain.
+ * @param bufsize Size of the registered buffer.
+ * @return 0 on successful execution. -1 on failure, including when io_uring is not available.
+ */
+int uring_queue::init(const unsigned depth, const size_t bufsize)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringfd = syscall(__NR_io_uring_setup, depth, &params);
+    if (ringfd == -1)
+        return -1;
+    entries = params.sq_entries;
+
+    sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqringsize = cqringsize = std::max(sqringsize, cqringsize);
+
+    sqring = mmap(NULL, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if (sqring == MAP_FAILED)
+    {
+        sqring = NULL;
+        return -1;
+    }
+
+    cqring = sqring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cqring = mmap(NULL, cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+        if (cqring == MAP_FAILED)
+        {
+            cqring = NULL;
+            return -1;
+        }
+    }
+
+    void *sqemap = mmap(NULL, entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES);
+    if (sqemap == MAP_FAILED)
+        return -1;
+    sqes = (io_uring_sqe *)sqemap;
+
+    char *sqbase = (char *)sqring, *cqbase = (char *)cqring;
+    sqhead = (unsigned *)(sqbase + params.sq_off.head);
+    sqtail = (unsigned *)(sqbase + params.sq_off.tail);
+    sqmask = (unsigned *)(sqbase + params.sq_off.ring_mask);
+    sqarray = (unsigned *)(sqbase + params.sq_off.array);
+    cqhead = (unsigned *)(cqbase + params.cq_off.head);
+    cqtail = (unsigned *)(cqbase + params.cq_off.tail);
+    cqmask = (unsigned *)(cqbase + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cqbase + params.cq_off.cqes);
+
+    // Registered buffers must be page backed, so we map it instead of using the heap.
+    void *bufmap = mmap(NULL, bufsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufmap == MAP_FAILED)
+        return -1;
+    buf = (char *)bufmap;
+    buflen = bufsize;
+
+    iovec iov{buf, buflen};
+    if (syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_BUFFERS, &iov, 1) != 0)
+        return -1;
+
+    expected = new uint32_t[entries];
+    return 0;
+}
+
+/**
+ * Queues a read into the registered buffer. Runs after the previously queued operations succeed.
+ */
+void uring_queue::queue_read(const int fd, char *data, const size_t length, const off_t offset)
+{
+    push(IORING_OP_READ_FIXED, fd, data, length, offset);
+}
+
+/**
+ * Queues a write from the registered buffer. Runs after the previously queued operations succeed.
+ */
+void uring_queue::queue_write(const int fd, char *data, const size_t length, const off_t offset)
+{
+    push(IORING_OP_WRITE_FIXED, fd, data, length, offset);
+}
+
+void uring_queue::push(const uint8_t opcode, const int fd, char *data, const size_t length, const off_t offset)
+{
+    const unsigned tail = *sqtail;
+    const unsigned index = tail & *sqmask;
+
+    io_uring_sqe &sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.flags = IOSQE_IO_LINK;
+    sqe.fd = fd;
+    sqe.addr = (uint64_t)data;
+    sqe.len = length;
+    sqe.off = offset;
+    sqe.buf_index = 0;
+    sqe.user_data = queued;
+
+    expected[queued++] = length;
+    sqarray[index] = index;
+    __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drops the queued operations without submitting them.
+ */
+void uring_queue::discard()
+{
+    __atomic_store_n(sqtail, *sqtail - queued, __ATOMIC_RELEASE);
+    queued = 0;
+}
+
+/**
+ * Submits the queued chain and waits until all of its operations complete.
+ * @return 0 if every operation transferred its full length. -1 on failure with errno of the first failed operation.
+ */
+int uring_queue::submit_wait()
+{
+    if (queued == 0)
+        return 0;
+
+    // The last operation ends the chain.
+    sqes[(*sqtail - 1) & *sqmask].flags &= ~IOSQE_IO_LINK;
+
+    unsigned tosubmit = queued, completed = 0;
+    int failure = 0;
+    while (completed < queued)
+    {
+        const int res = syscall(__NR_io_uring_enter, ringfd, tosubmit, queued - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0 && errno != EINTR)
+        {
+            std::cerr << errno << ": io_uring_enter failed\n";
+            // Submitted operations may still be running on our buffer. We cannot safely reuse the ring.
+            close(ringfd);
+            ringfd = -1;
+            queued = 0;
+            return -1;
+        }
+        if (res > 0)
+            tosubmit -= std::min<unsigned>(tosubmit, res);
+
+        unsigned head = *cqhead;
+        while (head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe &cqe = cqes[head & *cqmask];
+            if (failure == 0 && cqe.res != (int32_t)expected[cqe.user_data])
+                failure = cqe.res < 0 ? -cqe.res : EIO; // Short transfers break the chain as well.
+            else if (failure == ECANCELED && cqe.res < 0 && cqe.res != -ECANCELED)
+                failure = -cqe.res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    queued = 0;
+    if (failure != 0)
+    {
+        errno = failure;
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace statefs
@@ -0,0 +1,52 @@
+#ifndef _STATEFS_URING_QUEUE_
+#define _STATEFS_URING_QUEUE_
+
+#include <cstdint>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+namespace statefs
+{
+
+// Minimal io_uring submission queue owned by a single thread. It owns a buffer registered with the kernel
+// so reads and writes through it use fixed buffers. Operations are queued as one linked chain which executes
+// in order and stops at the first failure. The owning thread submits the chain and waits for its completions
+// with a single syscall.
+class uring_queue
+{
+private:
+    int ringfd = -1;
+    unsigned entries = 0;
+    unsigned queued = 0;
+
+    // Submission and completion rings shared with the kernel.
+    void *sqring = NULL, *cqring = NULL;
+    size_t sqringsize = 0, cqringsize = 0;
+    io_uring_sqe *sqes = NULL;
+    unsigned *sqhead = NULL, *sqtail = NULL, *sqmask = NULL, *sqarray = NULL;
+    unsigned *cqhead = NULL, *cqtail = NULL, *cqmask = NULL;
+    io_uring_cqe *cqes = NULL;
+
+    // Registered buffer.
+    char *buf = NULL;
+    size_t buflen = 0;
+
+    // Expected result length of each queued operation by its position in the chain.
+    uint32_t *expected = NULL;
+
+    void push(const uint8_t opcode, const int fd, char *data, const size_t length, const off_t offset);
+
+public:
+    ~uring_queue();
+    int init(const unsigned depth, const size_t bufsize);
+    bool is_open() const { return ringfd != -1; }
+    char *buffer() const { return buf; }
+    void queue_read(const int fd, char *data, const size_t length, const off_t offset);
+    void queue_write(const int fd, char *data, const size_t length, const off_t offset);
+    int submit_wait();
+    void discard();
+};
+
+} // namespace statefs
+
+#endif
@@ -3,204 +3,627 @@
 #include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
-#include <fstream>
+#include <sys/stat.h>
 #include <unordered_set>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <boost/filesystem.hpp>
 #include "state_restore.hpp"
 #include "hashtree_builder.hpp"
 #include "state_common.hpp"
+#include "reflink.hpp"
+#include "delta_manifest.hpp"
 
 namespace statefs
 {
 
-// Look at new files added and delete them if still exist.
-void state_restore::delete_newfiles()
+/**
+ * Reads the deltas of the given no. of latest generations, newest first.
+ * @return 0 on successful execution. -1 on failure, including when fewer generations are retained.
+ */
+int state_restore::load_levels(const uint64_t count)
 {
-    std::string indexfile(ctx.deltadir);
-    indexfile.append(IDX_NEWFILES);
+    checkpoint_window window;
+    if (read_checkpoint_window(window) == -1)
+        return -1;
 
-    std::ifstream infile(indexfile);
-    for (std::string file; std::getline(infile, file);)
+    const std::vector<uint64_t> live = list_live_generations(window);
+    if (live.size() < count)
     {
-        std::string filepath(ctx.datadir);
-        filepath.append(file);
+        std::cerr << "Cannot roll back " << count << " checkpoints. Only " << live.size() << " are retained.\n";
+        return -1;
+    }
 
-        std::remove(filepath.c_str());
+    for (auto itr = live.rbegin(); levels.size() < count; itr++)
+    {
+        const uint64_t generation = *itr;
+        const std::string deltadir = get_generation_deltadir(generation);
+
+        restore_level &level = levels.emplace_back();
+        level.generation = generation;
+        level.deltadir = deltadir;
+        if (read_delta_manifest(level.manifest, deltadir) != 0)
+            return -1;
+
+        std::unordered_set<std::string> newfiles;
+        read_newfiles(newfiles, deltadir);
+        level.newfiles.assign(newfiles.begin(), newfiles.end());
     }
 
-    infile.close();
+    return 0;
 }
 
-// Look at touched files and restore them.
-int state_restore::restore_touchedfiles()
+/**
+ * Combines the touched files of all the generations being rolled back. Files are followed across generations
+ * by path, from the oldest generation to the newest, to find the path each file had at the start of the
+ * oldest generation. Files created after that start are left out since they go away.
+ */
+void state_restore::merge_levels()
 {
-    std::unordered_set<std::string> processed;
-
-    std::string indexfile(ctx.deltadir);
-    indexfile.append(IDX_TOUCHEDFILES);
+    // Path at the end of the generations merged so far-->path at the start, of the files touched so far.
+    std::unordered_map<std::string, std::string> startpaths;
+    // Paths at the end of the generations merged so far holding files which were created after the start.
+    std::unordered_set<std::string> newpaths;
 
-    std::ifstream infile(indexfile);
-    for (std::string file; std::getline(infile, file);)
+    for (auto itr = levels.rbegin(); itr != levels.rend(); itr++)
     {
-        // Skip if already processed.
-        if (processed.count(file) > 0)
-            continue;
-
-        std::vector<char> bindex;
-        if (read_blockindex(bindex, file) != 0)
-            return -1;
-
-        if (restore_blocks(file, bindex) != 0)
-            return -1;
+        // Every file of a generation is looked up by the path it had at the start of that generation,
+        // so paths are moved on only after all of them are looked up.
+        std::vector<std::pair<std::string, const delta_file *>> touched;
+        for (const delta_file &file : itr->manifest.files)
+        {
+            std::string startpath;
+            const auto pathitr = startpaths.find(file.relpath);
+            if (pathitr != startpaths.end())
+                startpath = pathitr->second;
+            else if (newpaths.count(file.relpath) == 0)
+                startpath = file.relpath; // Untouched until this generation.
+
+            if (!startpath.empty())
+                add_part(files[startpath], file);
+            touched.emplace_back(std::move(startpath), &file);
+        }
 
-        // Add to processed file list.
-        processed.emplace(file);
+        for (const auto &[startpath, file] : touched)
+        {
+            startpaths.erase(file->relpath);
+            newpaths.erase(file->relpath);
+        }
+        for (const auto &[startpath, file] : touched)
+        {
+            if (file->deleted)
+                continue;
+            if (startpath.empty())
+                newpaths.emplace(file->currentpath);
+            else
+                startpaths[file->currentpath] = startpath;
+        }
+        for (const std::string &newfile : itr->newfiles)
+        {
+            startpaths.erase(newfile);
+            newpaths.emplace(newfile);
+        }
     }
 
-    infile.close();
-    return 0;
+    for (const auto &[currentpath, startpath] : startpaths)
+        files[startpath].currentpath = currentpath;
 }
 
-// Read the delta block index.
-int state_restore::read_blockindex(std::vector<char> &buffer, std::string_view file)
+/**
+ * Adds the preserved blocks of a file from a newer generation than the ones already added. Blocks already
+ * covered by an older generation and blocks beyond the length the file is restored to are left out.
+ */
+void state_restore::add_part(restore_file &file, const delta_file &deltafile)
 {
-    std::string bindexfile(ctx.deltadir);
-    bindexfile.append(file).append(BLOCKINDEX_EXT);
-    std::ifstream infile(bindexfile, std::ios::binary | std::ios::ate);
-    std::streamsize idxsize = infile.tellg();
-    infile.seekg(0, std::ios::beg);
+    if (file.blocksize == 0)
+    {
+        file.original_length = deltafile.original_length;
+        file.blocksize = deltafile.blocksize;
+    }
 
-    buffer.resize(idxsize);
-    if (!infile.read(buffer.data(), idxsize))
+    const auto is_covered = [&](const uint32_t blockno) {
+        const uint64_t offset = (uint64_t)blockno * deltafile.blocksize;
+        for (const delta_file &part : file.parts)
+        {
+            // Block sizes are powers of two, so a block either lies within a block of another size or spans whole ones.
+            const uint64_t first = offset / part.blocksize;
+            const uint64_t last = (offset + deltafile.blocksize - 1) / part.blocksize;
+            bool covered = true;
+            for (uint64_t no = first; no <= last && covered; no++)
+                covered = part.blocks.count(no) > 0;
+            if (covered)
+                return true;
+        }
+        return false;
+    };
+
+    delta_file part;
+    part.relpath = deltafile.relpath;
+    part.blocksize = deltafile.blocksize;
+    part.cachefile = deltafile.cachefile;
+    for (const auto &[blockno, block] : deltafile.blocks)
     {
-        std::cerr << errno << ": Read failed " << bindexfile << "\n";
-        return -1;
+        if ((off_t)blockno * deltafile.blocksize < file.original_length && !is_covered(blockno))
+            part.blocks.emplace(blockno, block);
     }
 
+    if (!part.blocks.empty())
+        file.parts.push_back(std::move(part));
+}
+
+/**
+ * Brings the file paths back to the start of a generation. New files are deleted, renames are undone and
+ * deleted files which were kept as links are moved back. Generations must be undone newest first.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::undo_level(const restore_level &level)
+{
+    delete_newfiles(level);
+    if (undo_renames(level.manifest) != 0 || relink_deletedfiles(level.manifest) != 0)
+        return -1;
     return 0;
 }
 
-// Restore blocks mentioned in the delta block index.
-int state_restore::restore_blocks(std::string_view file, const std::vector<char> &bindex)
+// Look at new files added and delete them if still exist.
+void state_restore::delete_newfiles(const restore_level &level)
 {
-    int bcachefd = 0, orifilefd = 0;
-    const char *idxptr = bindex.data();
+    for (const std::string &file : level.newfiles)
+    {
+        std::string filepath(ctx.datadir);
+        filepath.append(file);
 
-    // First 8 bytes of the index contains the supposed length of the original file.
-    off_t originallen = 0;
-    memcpy(&originallen, idxptr, 8);
+        std::remove(filepath.c_str());
+    }
+}
 
-    // Open block cache file.
+// Look at touched files and restore them.
+int state_restore::restore_touchedfiles()
+{
+    // Blocks kept in the block store are read from there instead of the segment.
+    const bool usesstore = std::any_of(levels.begin(), levels.end(), [](const restore_level &level) { return !level.manifest.storerefs.empty(); });
+    if (usesstore)
     {
-        std::string bcachefile(ctx.deltadir);
-        bcachefile.append(file).append(BLOCKCACHE_EXT);
-        bcachefd = open(bcachefile.c_str(), O_RDONLY);
-        if (bcachefd <= 0)
+        const std::string storefile = statehistdir + BLOCKSTORE_DIR + BLOCKSTORE_DATA_FNAME;
+        storefd = open(storefile.c_str(), O_RDONLY);
+        if (storefd == -1)
         {
-            std::cerr << errno << ": Open failed " << bcachefile << "\n";
+            std::cerr << errno << ": Open failed " << storefile << "\n";
             return -1;
         }
     }
 
-    // Create or Open original file.
+    // Cache file-->fd. Blocks of all the files of a generation live in the same segment unless the delta
+    // has the old per-file layout.
+    std::unordered_map<std::string, int> cachefds;
+    int ret = 0;
+    for (const auto &[relpath, file] : files)
+    {
+        if (restore_blocks(relpath, file, cachefds) != 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+
+    for (const auto &[cachefile, fd] : cachefds)
+        close(fd);
+    if (storefd != -1)
+        close(storefd);
+    storefd = -1;
+    return ret;
+}
+
+// Move renamed files back to their original paths. Renames are undone in the reverse order so a file
+// is always moved out of a path before the file which was at that path earlier is moved back in.
+int state_restore::undo_renames(const delta_manifest &manifest)
+{
+    for (auto itr = manifest.renames.rbegin(); itr != manifest.renames.rend(); itr++)
     {
-        std::string originalfile(ctx.datadir);
-        originalfile.append(file);
+        const std::string frompath = ctx.datadir + itr->from;
+        const std::string topath = ctx.datadir + itr->to;
+        create_parentdir(frompath);
 
-        // Create directory tree if not exist so we are able to create the file.
-        boost::filesystem::path filedir = boost::filesystem::path(originalfile).parent_path();
-        if (created_dirs.count(filedir.string()) == 0)
+        // The file is not there if it got deleted after the rename. It is then restored from the delta.
+        if (rename(topath.c_str(), frompath.c_str()) == -1 && errno != ENOENT)
         {
-            boost::filesystem::create_directories(filedir);
-            created_dirs.emplace(filedir.string());
+            std::cerr << errno << ": Undo rename failed " << topath << " to " << frompath << "\n";
+            return -1;
         }
+    }
 
-        orifilefd = open(originalfile.c_str(), O_WRONLY | O_CREAT, FILE_PERMS);
-        if (orifilefd <= 0)
+    return 0;
+}
+
+// A deleted file is brought back by moving its preserved inode back to the original path.
+int state_restore::relink_deletedfiles(const delta_manifest &manifest)
+{
+    for (const delta_file &file : manifest.files)
+    {
+        if (file.linkfile.empty())
+            continue;
+
+        const std::string originalfile = ctx.datadir + file.relpath;
+        create_parentdir(originalfile);
+        if (rename(file.linkfile.c_str(), originalfile.c_str()) == -1)
         {
-            std::cerr << errno << ": Open failed " << originalfile << "\n";
+            std::cerr << errno << ": Relink failed " << file.linkfile << " to " << originalfile << "\n";
             return -1;
         }
     }
 
-    // Restore the blocks as specified in block index.
-    for (uint32_t idxoffset = 8; idxoffset < bindex.size();)
+    return 0;
+}
+
+// Create directory tree if not exist so we are able to create the file.
+void state_restore::create_parentdir(const std::string &filepath)
+{
+    boost::filesystem::path filedir = boost::filesystem::path(filepath).parent_path();
+    if (created_dirs.count(filedir.string()) == 0)
+    {
+        boost::filesystem::create_directories(filedir);
+        created_dirs.emplace(filedir.string());
+    }
+}
+
+// Restore the preserved blocks of a file.
+int state_restore::restore_blocks(const std::string &relpath, const restore_file &file, std::unordered_map<std::string, int> &cachefds)
+{
+    // Create or Open original file.
+    std::string originalfile(ctx.datadir);
+    originalfile.append(relpath);
+    create_parentdir(originalfile);
+
+    const int orifilefd = open(originalfile.c_str(), O_WRONLY | O_CREAT, FILE_PERMS);
+    if (orifilefd <= 0)
     {
-        // Find the block no. of where this block is from in the original file.
-        uint32_t blockno = 0;
-        memcpy(&blockno, idxptr + idxoffset, 4);
-        idxoffset += 4;
-        off_t orifileoffset = blockno * BLOCK_SIZE;
+        std::cerr << errno << ": Open failed " << originalfile << "\n";
+        return -1;
+    }
 
-        // Find the offset where the block is located in the block cache file.
-        off_t bcacheoffset;
-        memcpy(&bcacheoffset, idxptr + idxoffset, 8);
-        idxoffset += 40; // Skip the hash(32)
+    // Parts are restored newest first so where blocks of different sizes overlap, the older blocks end up on top.
+    for (auto itr = file.parts.rbegin(); itr != file.parts.rend(); itr++)
+    {
+        auto [fditr, inserted] = cachefds.try_emplace(itr->cachefile, -1);
+        if (inserted)
+            fditr->second = open(itr->cachefile.c_str(), O_RDONLY);
+        if (fditr->second == -1)
+        {
+            std::cerr << errno << ": Open failed " << itr->cachefile << "\n";
+            close(orifilefd);
+            return -1;
+        }
 
-        // Transfer the cached block to the target file.
-        copy_file_range(bcachefd, &bcacheoffset, orifilefd, &orifileoffset, BLOCK_SIZE, 0);
+        const int ret = with_blocksize(itr->blocksize, [&](auto blocksize) {
+            return restore_extents<decltype(blocksize)::value>(*itr, fditr->second, orifilefd);
+        });
+        if (ret != 0)
+        {
+            close(orifilefd);
+            return -1;
+        }
     }
 
-    // If the target file is bigger than the original size, truncate it to the original size.
+    // If the target file is bigger than the original size, truncate it to the original size. It can be smaller
+    // if zero blocks at the end were restored as holes. Extending it brings those back.
     off_t currentlen = lseek(orifilefd, 0, SEEK_END);
-    if (currentlen > originallen)
-        ftruncate(orifilefd, originallen);
+    if (currentlen != file.original_length)
+        ftruncate(orifilefd, file.original_length);
 
-    close(bcachefd);
     close(orifilefd);
 
     return 0;
 }
 
-// This is called after a rollback so the all checkpoint dirs shift by 1.
-void state_restore::rewind_checkpoints()
+/**
+ * Restores the preserved blocks of a file in block no. order. Consecutive blocks that are also contiguous
+ * in the cache file are restored as a single extent. Zero blocks are restored as holes. Compressed blocks
+ * are decompressed into place after the raw ones, and so are the blocks kept in the block store.
+ * Instantiated per block size of the file.
+ * @return 0 on successful execution. -1 on failure.
+ */
+template <size_t BS>
+int state_restore::restore_extents(const delta_file &file, const int bcachefd, const int orifilefd)
 {
-    // Assuming we have restored the current state with current delta,
-    // we need to shift each history delta by 1 place.
+    std::vector<std::pair<uint32_t, const delta_block *>> compressedblocks, storeblocks;
+    off_t extentorioffset = 0, extentcacheoffset = 0;
+    size_t extentlength = 0;
+    off_t zerooffset = 0;
+    size_t zerolength = 0;
+    for (const auto &[blockno, block] : file.blocks)
+    {
+        if (block.instore)
+        {
+            storeblocks.emplace_back(blockno, &block);
+            continue;
+        }
 
-    // Delete the state 0 (current) delta.
-    boost::filesystem::remove_all(ctx.deltadir);
+        if (block.codec != block_codec::NONE)
+        {
+            compressedblocks.emplace_back(blockno, &block);
+            continue;
+        }
 
-    int16_t oldest_chkpnt = (MAX_CHECKPOINTS + 1) * -1; // +1 because we maintain one extra checkpoint in case of rollbacks.
-    for (int16_t chkpnt = -1; chkpnt >= oldest_chkpnt; chkpnt--)
+        // Consecutive zero blocks are restored together as a hole.
+        if (block.storedlength == 0)
+        {
+            if (zerolength > 0 && (off_t)blockno * (off_t)BS == zerooffset + (off_t)zerolength)
+            {
+                zerolength += BS;
+                continue;
+            }
+            if (zerolength > 0 && restore_zeros(orifilefd, zerooffset, zerolength) != 0)
+                return -1;
+            zerooffset = (off_t)blockno * BS;
+            zerolength = BS;
+            continue;
+        }
+
+        const off_t orifileoffset = (off_t)blockno * BS;
+        if (extentlength > 0 &&
+            orifileoffset == extentorioffset + (off_t)extentlength &&
+            block.cacheoffset == extentcacheoffset + (off_t)extentlength)
+        {
+            extentlength += BS;
+            continue;
+        }
+
+        if (extentlength > 0 && restore_extent(bcachefd, extentcacheoffset, orifilefd, extentorioffset, extentlength) != 0)
+            return -1;
+
+        extentorioffset = orifileoffset;
+        extentcacheoffset = block.cacheoffset;
+        extentlength = BS;
+    }
+
+    if (extentlength > 0 && restore_extent(bcachefd, extentcacheoffset, orifilefd, extentorioffset, extentlength) != 0)
+        return -1;
+
+    if (zerolength > 0 && restore_zeros(orifilefd, zerooffset, zerolength) != 0)
+        return -1;
+
+    if (!compressedblocks.empty() && restore_blocklist(file, bcachefd, orifilefd, compressedblocks) != 0)
+        return -1;
+
+    if (!storeblocks.empty() && restore_blocklist(file, storefd, orifilefd, storeblocks) != 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Restores a range of zero blocks by punching a hole over it. Zeros are written instead if the file
+ * system does not support holes.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::restore_zeros(const int orifilefd, off_t orifileoffset, const size_t length)
+{
+    if (fallocate(orifilefd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, orifileoffset, length) == 0)
+        return 0;
+
+    for (const off_t end = orifileoffset + length; orifileoffset < end;)
     {
-        std::string dir = get_statedir_root(chkpnt);
+        const ssize_t res = pwrite(orifilefd, ZERO_BLOCK, std::min<off_t>(end - orifileoffset, LARGE_BLOCK_SIZE), orifileoffset);
+        if (res <= 0)
+        {
+            std::cerr << errno << ": Block restore failed at offset " << orifileoffset << "\n";
+            return -1;
+        }
+        orifileoffset += res;
+    }
+
+    return 0;
+}
 
-        if (boost::filesystem::exists(dir))
+/**
+ * Reads the given blocks of a file one by one, decompressing them as needed, and writes them into place.
+ * Files with many such blocks are split across several threads.
+ * @param bcachefd fd of the file holding the blocks.
+ * @param blocks Block no. and preserved block of each block.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::restore_blocklist(const delta_file &file, const int bcachefd, const int orifilefd, const std::vector<std::pair<uint32_t, const delta_block *>> &blocks)
+{
+    std::atomic<int> ret{0};
+    const auto restore_range = [&](const size_t begin, const size_t end) {
+        std::vector<char> buf(file.blocksize);
+        for (size_t idx = begin; idx < end && ret == 0; idx++)
         {
-            if (chkpnt == -1)
+            const off_t orifileoffset = (off_t)blocks[idx].first * file.blocksize;
+            if (read_delta_block(bcachefd, *blocks[idx].second, buf.data(), file.blocksize) != 0 ||
+                pwrite(orifilefd, buf.data(), file.blocksize, orifileoffset) != file.blocksize)
             {
-                // Shift -1 state delta dir to 0-state and delete -1 dir.
-                std::string delta_1 = dir + DELTA_DIR;
-                boost::filesystem::rename(delta_1, ctx.deltadir);
-                boost::filesystem::remove_all(dir);
+                std::cerr << errno << ": Block restore failed at offset " << orifileoffset << "\n";
+                ret = -1;
             }
-            else
+        }
+    };
+
+    const size_t threadcount = std::min(RESTORE_THREAD_COUNT, blocks.size() / RESTORE_BLOCKS_PER_THREAD);
+    if (threadcount <= 1)
+    {
+        restore_range(0, blocks.size());
+        return ret;
+    }
+
+    const size_t perthread = (blocks.size() + threadcount - 1) / threadcount;
+    std::vector<std::thread> threads;
+    for (size_t begin = 0; begin < blocks.size(); begin += perthread)
+        threads.emplace_back(restore_range, begin, std::min(begin + perthread, blocks.size()));
+    for (std::thread &thread : threads)
+        thread.join();
+
+    return ret;
+}
+
+/**
+ * Transfers a contiguous range of cached blocks to the target file. If the file system supports reflinks
+ * the target range is made to share the cached extents. Otherwise the bytes are copied in the kernel.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::restore_extent(const int bcachefd, off_t bcacheoffset, const int orifilefd, off_t orifileoffset, const size_t length)
+{
+    if (reflink_supported)
+    {
+        if (clone_range(bcachefd, bcacheoffset, orifilefd, orifileoffset, length) == 0)
+            return 0;
+        if (is_reflink_unsupported_error(errno))
+            reflink_supported = false;
+    }
+
+    size_t remaining = length;
+    while (remaining > 0)
+    {
+        const ssize_t res = copy_file_range(bcachefd, &bcacheoffset, orifilefd, &orifileoffset, remaining, 0);
+        if (res <= 0)
+        {
+            std::cerr << errno << ": Block restore failed at offset " << orifileoffset << "\n";
+            return -1;
+        }
+        remaining -= res;
+    }
+
+    return 0;
+}
+
+/**
+ * Updates the hash tree for the rolled back files in one pass. The touched files of all the generations are
+ * described to the hash tree builder as a single delta going from the state before the rollback to the start
+ * of the oldest generation.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::update_hashtree()
+{
+    delta_manifest merged;
+    std::vector<std::string> hintpaths;
+    for (const auto &[relpath, file] : files)
+    {
+        delta_file &mergedfile = merged.files.emplace_back();
+        mergedfile.relpath = relpath;
+        mergedfile.currentpath = file.currentpath.empty() ? relpath : file.currentpath;
+        mergedfile.deleted = file.currentpath.empty();
+        mergedfile.original_length = file.original_length;
+
+        // Blocks of all the parts are marked changed in the smallest block size among them.
+        mergedfile.blocksize = file.blocksize;
+        for (const delta_file &part : file.parts)
+            mergedfile.blocksize = std::min(mergedfile.blocksize, part.blocksize);
+        for (const delta_file &part : file.parts)
+        {
+            for (const auto &[blockno, block] : part.blocks)
             {
-                std::string dirshift = get_statedir_root(chkpnt + 1);
-                boost::filesystem::rename(dir, dirshift);
+                const uint64_t offset = (uint64_t)blockno * part.blocksize;
+                for (uint64_t no = offset / mergedfile.blocksize; no < (offset + part.blocksize) / mergedfile.blocksize; no++)
+                    mergedfile.blocks.try_emplace(no, block);
             }
         }
+
+        const size_t pos = merged.files.size() - 1;
+        merged.filepositions[relpath] = pos;
+        if (!mergedfile.deleted)
+            merged.currentpositions[mergedfile.currentpath] = pos;
+    }
+
+    // Every path a file had in between may have a hash map which has to go.
+    for (const restore_level &level : levels)
+    {
+        for (const delta_file &file : level.manifest.files)
+        {
+            hintpaths.push_back(file.relpath);
+            if (!file.deleted)
+                hintpaths.push_back(file.currentpath);
+        }
+        for (const delta_rename &rename : level.manifest.renames)
+        {
+            hintpaths.push_back(rename.from);
+            hintpaths.push_back(rename.to);
+        }
+        hintpaths.insert(hintpaths.end(), level.newfiles.begin(), level.newfiles.end());
     }
+
+    hashtree_builder htreebuilder(ctx, true);
+    return htreebuilder.generate(std::move(merged), hintpaths);
 }
 
-// Rolls back current state to previous state.
-int state_restore::rollback()
+/**
+ * Moves the checkpoint window back after a rollback so the checkpoint rolled back to becomes the current one
+ * again, and drops the deltas of the rolled back generations. The window is written before the deltas are
+ * removed so it never points at a generation whose delta is gone.
+ * @return 0 on successful execution. -1 on failure.
+ */
+int state_restore::rewind_checkpoints()
+{
+    checkpoint_window window;
+    if (read_checkpoint_window(window) == -1)
+        return -1;
+
+    // The rolled back generation nos. are not reissued. Earlier rollbacks may have left gaps before them.
+    std::vector<uint64_t> live = list_live_generations(window);
+    const uint64_t oldestlevel = levels.back().generation;
+    live.erase(std::remove_if(live.begin(), live.end(), [&](const uint64_t generation) { return generation >= oldestlevel; }),
+               live.end());
+    if (!live.empty())
+    {
+        window.current = live.back();
+    }
+    else
+    {
+        // No earlier checkpoint left. The current session starts over with an empty delta in a new generation.
+        window.current = window.next++;
+        const std::string deltadir = get_generation_deltadir(window.current);
+        if (mkdir(deltadir.c_str(), 0755) == -1 && errno != EEXIST)
+        {
+            std::cerr << errno << ": Creating delta dir failed " << deltadir << "\n";
+            return -1;
+        }
+    }
+
+    if (write_checkpoint_window(window) == -1)
+        return -1;
+
+    // The rolled back deltas are outside the window from now on. One left behind only takes up space.
+    for (const restore_level &level : levels)
+    {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(level.deltadir, ec);
+        if (ec)
+            std::cerr << ec.value() << ": Removing rolled back delta failed " << level.deltadir << "\n";
+    }
+    return 0;
+}
+
+/**
+ * Rolls back current state to the state of an earlier checkpoint. The deltas of all the generations in between
+ * are merged so every file and block is restored once and the hash tree is updated once.
+ * @param count No. of generations to roll back. 1 rolls back the current session to the latest checkpoint.
+ * @return 0 on successful execution. -1 on failure. The state is partly rolled back if changed is set.
+ */
+int state_restore::rollback(const uint64_t count)
 {
     ctx = get_statedir_context();
+    if (count == 0 || ctx.deltadir.empty() || load_levels(count) == -1)
+        return -1;
+    merge_levels();
+
+    // Nothing has been changed up to here. A failure from here on leaves the state partly rolled back.
+    changed = true;
+    for (const restore_level &level : levels)
+    {
+        if (undo_level(level) == -1)
+            return -1;
+    }
 
-    delete_newfiles();
     if (restore_touchedfiles() == -1)
         return -1;
 
-    // Update hash tree.
-    hashtree_builder htreebuilder(ctx);
-    htreebuilder.generate();
-
-    rewind_checkpoints();
+    if (update_hashtree() == -1)
+    {
+        std::cerr << "Hash tree update of the rolled back state failed\n";
+        return -1;
+    }
 
-    return 0;
+    return rewind_checkpoints();
 }
 
 } // namespace statefs
\ No newline at end of file
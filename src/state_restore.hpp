@@ -2,26 +2,72 @@
 #define _STATEFS_STATE_RESTORE_
 
 #include <string>
+#include <map>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include "state_common.hpp"
+#include "delta_manifest.hpp"
 
 namespace statefs
 {
 
+// Max. no. of threads decompressing the compressed blocks of a file on restore, and the min. no. of blocks per thread.
+constexpr size_t RESTORE_THREAD_COUNT = 4;
+constexpr size_t RESTORE_BLOCKS_PER_THREAD = 256;
+
+// Delta of one checkpoint generation being rolled back.
+struct restore_level
+{
+    uint64_t generation = 0;
+    std::string deltadir;
+    delta_manifest manifest;
+    std::vector<std::string> newfiles; // Files created during the generation, at their paths at its end.
+};
+
+// A file restored to its state at the start of the oldest generation being rolled back. Each block is restored
+// from the oldest generation which preserved it, so every block gets written once.
+struct restore_file
+{
+    off_t original_length = 0;
+    uint32_t blocksize = 0;  // Block size of the file in the oldest generation which touched it.
+    std::string currentpath; // Where the file is before the rollback. Empty if it is not there any more.
+
+    // Blocks taken from each generation which touched the file, oldest first. Each part holds the
+    // block size and the cache file of its generation.
+    std::vector<delta_file> parts;
+};
+
 class state_restore
 {
 private:
     statedir_context ctx;
     std::unordered_set<std::string> created_dirs;
-    void delete_newfiles();
+    bool reflink_supported = true; // Cleared on the first clone failure due to file system.
+    std::vector<restore_level> levels;        // Generations being rolled back, newest first.
+    std::map<std::string, restore_file> files; // Path at the start of the oldest generation-->file to restore.
+    int load_levels(const uint64_t count);
+    void merge_levels();
+    void add_part(restore_file &file, const delta_file &deltafile);
+    int undo_level(const restore_level &level);
+    void delete_newfiles(const restore_level &level);
     int restore_touchedfiles();
-    int read_blockindex(std::vector<char> &buffer, std::string_view file);
-    int restore_blocks(std::string_view file, const std::vector<char> &bindex);
-    void rewind_checkpoints();
+    int undo_renames(const delta_manifest &manifest);
+    int relink_deletedfiles(const delta_manifest &manifest);
+    void create_parentdir(const std::string &filepath);
+    int storefd = -1; // Block store data file. Opened if a delta references the block store.
+    int restore_blocks(const std::string &relpath, const restore_file &file, std::unordered_map<std::string, int> &cachefds);
+    template <size_t BS>
+    int restore_extents(const delta_file &file, const int bcachefd, const int orifilefd);
+    int restore_extent(const int bcachefd, off_t bcacheoffset, const int orifilefd, off_t orifileoffset, const size_t length);
+    int restore_zeros(const int orifilefd, off_t orifileoffset, const size_t length);
+    int restore_blocklist(const delta_file &file, const int bcachefd, const int orifilefd, const std::vector<std::pair<uint32_t, const delta_block *>> &blocks);
+    int update_hashtree();
+    int rewind_checkpoints();
 
 public:
-    int rollback();
+    bool changed = false; // Whether the rollback has started changing the state.
+    int rollback(const uint64_t count = 1);
 };
 
 } // namespace statefs
@@ -0,0 +1,80 @@
+#!/bin/bash
+# Round trip of reflink based preservation and restore on a loopback XFS image.
+# Modifies a state through the monitor, checks the preserved blocks share extents with the originals,
+# then rolls the checkpoint back and checks the state is byte for byte the original again.
+# Requires root (loop mount), mkfs.xfs (xfsprogs), fusermount3 and filefrag.
+# Usage: reflink_roundtrip.sh <dir holding the statemon and hashmap binaries>
+
+set -euo pipefail
+
+BINDIR=$(realpath "${1:-build}")
+WORKDIR=$(mktemp -d)
+XFSMNT=$WORKDIR/xfs
+FUSEMNT=$WORKDIR/fuse
+HISTDIR=$XFSMNT/hist
+SNAPDIR=$WORKDIR/snap
+STATEMON_PID=
+
+cleanup()
+{
+    if [ -n "$STATEMON_PID" ]; then
+        fusermount3 -u $FUSEMNT 2>/dev/null || true
+        wait $STATEMON_PID 2>/dev/null || true
+    fi
+    umount $XFSMNT 2>/dev/null || true
+    rm -rf $WORKDIR
+}
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+truncate -s 512M $WORKDIR/xfs.img
+mkfs.xfs -q -m reflink=1 $WORKDIR/xfs.img
+mkdir -p $XFSMNT $FUSEMNT
+mount -o loop $WORKDIR/xfs.img $XFSMNT
+
+# Original state. Some sizes are not block aligned so partial last blocks take the copy path.
+mkdir -p $HISTDIR/0/data/dir
+head -c 8M /dev/urandom > $HISTDIR/0/data/big
+head -c 300001 /dev/urandom > $HISTDIR/0/data/mid
+head -c 70000 /dev/urandom > $HISTDIR/0/data/dir/small
+head -c 1M /dev/urandom > $HISTDIR/0/data/trunc
+head -c 200000 /dev/urandom > $HISTDIR/0/data/deleted
+$BINDIR/hashmap $HISTDIR > /dev/null
+cp -a $HISTDIR/0/data $SNAPDIR
+
+# Preserve. Blocks are only cloned in kernel copy mode. With 64K blocks, a 4K write leaves the rest
+# of its preserved block shared between the original file and the segment.
+$BINDIR/statemon $HISTDIR $FUSEMNT --copy=kernel --reflink=on --blocksize=65536 > $WORKDIR/statemon.log 2>&1 &
+STATEMON_PID=$!
+for i in $(seq 50); do
+    mountpoint -q $FUSEMNT && break
+    sleep 0.1
+done
+mountpoint -q $FUSEMNT || fail "statemon did not mount $FUSEMNT"
+
+dd if=/dev/urandom of=$FUSEMNT/big bs=4K count=1 seek=41 conv=notrunc status=none
+dd if=/dev/urandom of=$FUSEMNT/big bs=64K count=16 seek=64 conv=notrunc status=none
+dd if=/dev/urandom of=$FUSEMNT/mid bs=4K count=4 seek=70 conv=notrunc status=none
+echo appended >> $FUSEMNT/dir/small
+head -c 5000 /dev/urandom > $FUSEMNT/trunc
+truncate -s 3000000 $FUSEMNT/big
+rm $FUSEMNT/deleted
+head -c 9000 /dev/urandom > $FUSEMNT/new
+
+fusermount3 -u $FUSEMNT
+wait $STATEMON_PID || fail "statemon exited with an error"
+STATEMON_PID=
+
+GENERATION=$(ls $HISTDIR/deltas | sort -n | tail -1)
+filefrag -v $HISTDIR/deltas/$GENERATION/segment.blk | grep -q shared || fail "preserved blocks were copied instead of cloned"
+
+# Roll back.
+$BINDIR/hashmap restore $HISTDIR > /dev/null
+diff -r $SNAPDIR $HISTDIR/0/data || fail "restored state differs from the original"
+
+echo "PASS"